@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# bench-command-client.sh
+# Runs dropbox-bench against a fresh fake-dropboxd.
+#
+# This file is part of caja-dropbox.
+#
+# caja-dropbox is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# caja-dropbox is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+#
+# usage: bench-command-client.sh [BUILDDIR/src] [fake-dropboxd options]
+#
+# Runs a sequential and a windowed lookup benchmark with the command
+# client BUILDDIR was configured with.  To compare the threaded and the
+# main loop client, configure two build directories, one of them with
+# --enable-mainloop-command-client, and run this for each.
+
+set -e
+
+dir=${1:-.}
+[ $# -gt 0 ] && shift
+
+out=$(mktemp)
+"$dir/fake-dropboxd" "$@" > "$out" &
+daemon=$!
+trap 'kill $daemon 2> /dev/null; rm -f "$out"' EXIT
+
+# it prints HOME=... once the sockets are up
+while ! grep -q '^HOME=' "$out"; do
+    kill -0 $daemon
+    sleep 0.1
+done
+home=$(sed -n 's/^HOME=//p' "$out")
+
+for window in 1 64; do
+    HOME="$home" "$dir/dropbox-bench" --lookups 2000 --window $window \
+        "$home/.dropbox/command_socket"
+done
@@ -32,8 +32,11 @@
 #include <sys/un.h>
 #include <unistd.h>
 
-#include "async-io-coroutine.h"
 #include "dropbox-client-util.h"
+#include "dropbox-probes.h"
+#include "dropbox-recorder.h"
+#include "dropbox-stats.h"
+#include "dropbox-watchdog.h"
 
 typedef struct {
   DropboxUpdateHook hook;
@@ -42,114 +45,381 @@ typedef struct {
 
 static gboolean try_to_connect(CajaDropboxHookserv *hookserv);
 
-static gboolean handle_hook_server_input(GIOChannel *chan, GIOCondition cond,
-                                         CajaDropboxHookserv *hookserv) {
-  /* we have some sweet macros defined that allow us to write this
-     async event handler like a microthread yeahh, watch out for context */
-  CRBEGIN(hookserv->hhsi.line);
-  while (1) {
-    hookserv->hhsi.command_args = g_hash_table_new_full(
-        (GHashFunc)g_str_hash, (GEqualFunc)g_str_equal, (GDestroyNotify)g_free,
-        (GDestroyNotify)g_strfreev);
-    hookserv->hhsi.numargs = 0;
-
-    /* read the command name */
-    {
-      gchar *line;
-      CRREADLINE(hookserv->hhsi.line, chan, line);
-      hookserv->hhsi.command_name = dropbox_client_util_desanitize(line);
-      g_free(line);
-    }
+typedef struct {
+  gchar *command_name;
+  GHashTable *command_args;
+  gint64 read_time;
+} HookMessage;
+
+/* how long one main loop iteration may spend running hooks (in
+   microseconds), the rest waits for the next one so a storm of messages
+   can't keep caja from redrawing */
+#define HOOK_DISPATCH_BUDGET (5 * 1000)
+
+static void hook_message_free(HookMessage *msg) {
+  g_free(msg->command_name);
+  g_hash_table_unref(msg->command_args);
+  g_free(msg);
+}
 
-    /* now read each arg line (until a certain limit) until we receive "done" */
-    while (1) {
-      gchar *line;
+/* for the probes */
+static G_GNUC_UNUSED const gchar *message_path(HookMessage *msg) {
+  gchar **path = g_hash_table_lookup(msg->command_args, "path");
 
-      /* if too many arguments, this connection seems malicious */
-      if (hookserv->hhsi.numargs >= 20) {
-        CRHALT;
-      }
+  return path != NULL ? path[0] : NULL;
+}
 
-      CRREADLINE(hookserv->hhsi.line, chan, line);
+/* returns TRUE if messages are left over for the next iteration */
+static gboolean run_hooks(CajaDropboxHookserv *hookserv) {
+  gint64 deadline = g_get_monotonic_time() + HOOK_DISPATCH_BUDGET;
+  HookMessage *msg;
+  guint dispatched = 0;
+
+  while ((msg = g_queue_pop_head(&(hookserv->hhsi.pending))) != NULL) {
+    HookData *hd;
+
+    hd = (HookData *)g_hash_table_lookup(hookserv->dispatch_table,
+                                         msg->command_name);
+    if (hd != NULL) {
+      gint64 start = g_get_monotonic_time();
+
+      dropbox_stats_record(msg->command_name, DROPBOX_STATS_QUEUE,
+                           start - msg->read_time);
+      DROPBOX_PROBE(hook__dispatch, msg->command_name, message_path(msg), 0);
+      (hd->hook)(msg->command_args, hd->ud);
+      dropbox_stats_record_since(msg->command_name, DROPBOX_STATS_RUN, start);
+    }
+    hook_message_free(msg);
+    dispatched++;
+
+    if (!g_queue_is_empty(&(hookserv->hhsi.pending)) &&
+        g_get_monotonic_time() >= deadline) {
+      g_debug("ran %u hooks, %u left for later", dispatched,
+              g_queue_get_length(&(hookserv->hhsi.pending)));
+      return TRUE;
+    }
+  }
 
-      if (strcmp("done", line) == 0) {
-        g_free(line);
-        break;
-      } else {
-        gboolean parse_result;
+  return FALSE;
+}
 
-        parse_result = dropbox_client_util_command_parse_arg(
-            line, hookserv->hhsi.command_args);
-        g_free(line);
+static gboolean dispatch_pending_hooks(CajaDropboxHookserv *hookserv) {
+  gboolean more;
 
-        if (FALSE == parse_result) {
-          g_debug("bad parse");
-          CRHALT;
-        }
-      }
+  dropbox_watchdog_enter("hooks.dispatch");
+  if (!(more = run_hooks(hookserv))) {
+    hookserv->hhsi.dispatch_source = 0;
+  }
+  dropbox_watchdog_leave();
+
+  return more;
+}
 
-      hookserv->hhsi.numargs += 1;
+/* the lines of a message, without "done".  NULL on a bad arg line */
+static HookMessage *parse_hook_message(const gchar *raw) {
+  HookMessage *msg;
+  gchar **lines;
+  int i;
+
+  lines = g_strsplit(raw, "\n", -1);
+  msg = g_new(HookMessage, 1);
+  msg->read_time = g_get_monotonic_time();
+  msg->command_name = dropbox_client_util_desanitize(lines[0]);
+  msg->command_args = g_hash_table_new_full(
+      (GHashFunc)g_str_hash, (GEqualFunc)g_str_equal, (GDestroyNotify)g_free,
+      (GDestroyNotify)g_strfreev);
+
+  for (i = 1; lines[i] != NULL; i++) {
+    if (dropbox_client_util_command_parse_arg(lines[i], msg->command_args) ==
+        FALSE) {
+      g_debug("bad parse");
+      hook_message_free(msg);
+      msg = NULL;
+      break;
     }
+  }
+
+  g_strfreev(lines);
+  return msg;
+}
+
+static gboolean deliver_hook_batch(CajaDropboxHookserv *hookserv);
 
-    {
-      HookData *hd;
-      hd = (HookData *)g_hash_table_lookup(hookserv->dispatch_table,
-                                           hookserv->hhsi.command_name);
-      if (hd != NULL) {
-        (hd->hook)(hookserv->hhsi.command_args, hd->ud);
+/* reader thread, takes raw.  a message identical to one the main loop
+   hasn't picked up yet replaces it, at the later position */
+static void queue_hook_message(CajaDropboxHookserv *hookserv, gchar *raw,
+                               HookMessage *msg) {
+  guint index;
+
+  g_mutex_lock(&(hookserv->reader.mutex));
+  index = GPOINTER_TO_UINT(g_hash_table_lookup(hookserv->reader.seen, raw));
+  if (index != 0) {
+    hook_message_free(g_ptr_array_index(hookserv->reader.batch, index - 1));
+    g_ptr_array_index(hookserv->reader.batch, index - 1) = NULL;
+    dropbox_stats_add("hooks.deduplicated", 1);
+  }
+  g_ptr_array_add(hookserv->reader.batch, msg);
+  g_hash_table_insert(hookserv->reader.seen, raw,
+                      GUINT_TO_POINTER(hookserv->reader.batch->len));
+  g_mutex_unlock(&(hookserv->reader.mutex));
+
+  if (g_atomic_int_compare_and_exchange(&(hookserv->reader.idle), FALSE,
+                                        TRUE)) {
+    g_idle_add_full(G_PRIORITY_DEFAULT, (GSourceFunc)deliver_hook_batch,
+                    hookserv, NULL);
+  }
+}
+
+static gpointer read_hooks(CajaDropboxHookserv *hookserv) {
+  GString *buf = g_string_new(NULL);
+  /* the lines of the message being read */
+  GString *raw = NULL;
+  int numargs = 0;
+  gboolean ok = TRUE;
+
+  while (ok) {
+    gchar chunk[16384], *line;
+    gsize pos = 0;
+    gssize n;
+
+    /* force_reconnect shuts the socket down to get us out of here */
+    n = read(hookserv->socket, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      break;
+    }
+    g_string_append_len(buf, chunk, n);
+
+    while (ok && (line = dropbox_client_util_next_line(buf, &pos)) != NULL) {
+      if (raw == NULL) {
+        /* the command name */
+        raw = g_string_new(line);
+        numargs = 0;
+      } else if (strcmp("done", line) == 0) {
+        HookMessage *msg = parse_hook_message(raw->str);
+
+        dropbox_recorder_hook(hookserv->socket_path, raw->str);
+
+        if (msg != NULL) {
+          queue_hook_message(hookserv, g_string_free(raw, FALSE), msg);
+        } else {
+          g_string_free(raw, TRUE);
+          ok = FALSE;
+        }
+        raw = NULL;
+      } else if (numargs >= 20) {
+        /* if too many arguments, this connection seems malicious */
+        ok = FALSE;
+      } else {
+        g_string_append_c(raw, '\n');
+        g_string_append(raw, line);
+        numargs += 1;
       }
+      g_free(line);
     }
+    g_string_erase(buf, 0, pos);
+  }
 
-    g_free(hookserv->hhsi.command_name);
-    g_hash_table_unref(hookserv->hhsi.command_args);
-    hookserv->hhsi.command_name = NULL;
-    hookserv->hhsi.command_args = NULL;
+  if (raw != NULL) {
+    g_string_free(raw, TRUE);
   }
-  CREND;
+  g_string_free(buf, TRUE);
+
+  g_mutex_lock(&(hookserv->reader.mutex));
+  hookserv->reader.done = TRUE;
+  g_mutex_unlock(&(hookserv->reader.mutex));
+  if (g_atomic_int_compare_and_exchange(&(hookserv->reader.idle), FALSE,
+                                        TRUE)) {
+    g_idle_add_full(G_PRIORITY_DEFAULT, (GSourceFunc)deliver_hook_batch,
+                    hookserv, NULL);
+  }
+
+  return NULL;
 }
 
-static void watch_killer(CajaDropboxHookserv *hookserv) {
+static void reader_finished(CajaDropboxHookserv *hookserv) {
+  /* already handled this connection's end */
+  if (hookserv->reader.thread == NULL) {
+    return;
+  }
+
+  g_thread_join(hookserv->reader.thread);
+  hookserv->reader.thread = NULL;
+
   g_debug("hook client disconnected");
+  dropbox_stats_add("hooks.disconnects", 1);
+  DROPBOX_PROBE(disconnect, "hooks", hookserv->socket_path, 0);
 
   hookserv->connected = FALSE;
 
   g_hook_list_invoke(&(hookserv->ondisconnect_hooklist), FALSE);
 
-  /* we basically just have to free the memory allocated in the
-     handle_hook_server_init ctx */
-  if (hookserv->hhsi.command_name != NULL) {
-    g_free(hookserv->hhsi.command_name);
-    hookserv->hhsi.command_name = NULL;
-  }
-
-  if (hookserv->hhsi.command_args != NULL) {
-    g_hash_table_unref(hookserv->hhsi.command_args);
-    hookserv->hhsi.command_args = NULL;
-  }
+  /* messages that didn't get to run yet still run, a shell_touch the
+     daemon sent right before it went away is as true as any other.  the
+     next connection's messages queue up behind them. */
 
   g_io_channel_unref(hookserv->chan);
   hookserv->chan = NULL;
-  hookserv->event_source = 0;
   hookserv->socket = 0;
 
   /* lol we also have to start a new connection */
   try_to_connect(hookserv);
 }
 
+/* the per message cost on the main loop is moving a pointer */
+static gboolean deliver_hook_batch(CajaDropboxHookserv *hookserv) {
+  GPtrArray *batch;
+  gboolean done;
+  guint i;
+
+  dropbox_watchdog_enter("hooks.deliver");
+
+  /* clear this first, anything queued from now on gets another idle */
+  g_atomic_int_set(&(hookserv->reader.idle), FALSE);
+
+  g_mutex_lock(&(hookserv->reader.mutex));
+  batch = hookserv->reader.batch;
+  hookserv->reader.batch = g_ptr_array_new();
+  g_hash_table_remove_all(hookserv->reader.seen);
+  /* taken once, a later idle the reader scheduled before this one cleared
+     the flag mustn't see it again */
+  done = hookserv->reader.done;
+  hookserv->reader.done = FALSE;
+  g_mutex_unlock(&(hookserv->reader.mutex));
+
+  for (i = 0; i < batch->len; i++) {
+    if (g_ptr_array_index(batch, i) != NULL) {
+      g_queue_push_tail(&(hookserv->hhsi.pending),
+                        g_ptr_array_index(batch, i));
+    }
+  }
+  g_ptr_array_free(batch, TRUE);
+
+  /* the last batch of a connection runs like any other, what doesn't fit
+     in the budget runs after the disconnect has been handled */
+  if (hookserv->hhsi.dispatch_source == 0 && run_hooks(hookserv)) {
+    /* with a backlog the idle keeps going, after the older messages */
+    hookserv->hhsi.dispatch_source =
+        g_idle_add((GSourceFunc)dispatch_pending_hooks, hookserv);
+  }
+
+  if (done) {
+    reader_finished(hookserv);
+  }
+
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+/* how long a connect may stay in progress, and how long to wait before
+   trying again when the daemon isn't there (in milliseconds) */
+#define CONNECT_TIMEOUT 1000
+#define RECONNECT_INTERVAL 1000
+/* the daemon's listen backlog is full, it is alive so come back soon */
+#define RECONNECT_BUSY_INTERVAL 100
+
+static void retry_connect(CajaDropboxHookserv *hookserv, guint interval) {
+  if (hookserv->connect_source != 0) {
+    g_source_remove(hookserv->connect_source);
+    hookserv->connect_source = 0;
+  }
+  if (hookserv->connect_timeout != 0) {
+    g_source_remove(hookserv->connect_timeout);
+    hookserv->connect_timeout = 0;
+  }
+
+  /* the channel closes the socket */
+  if (hookserv->chan != NULL) {
+    g_io_channel_unref(hookserv->chan);
+    hookserv->chan = NULL;
+  } else {
+    close(hookserv->socket);
+  }
+  hookserv->socket = 0;
+
+  g_timeout_add(interval, (GSourceFunc)try_to_connect, hookserv);
+}
+
+static void finish_connect(CajaDropboxHookserv *hookserv) {
+  /* great we connected!, the channel just owns the socket from now on */
+  if (hookserv->chan == NULL) {
+    hookserv->chan = g_io_channel_unix_new(hookserv->socket);
+    g_io_channel_set_close_on_unref(hookserv->chan, TRUE);
+  }
+
+  /* the reader thread waits in read() */
+  {
+    int flags;
+
+    if ((flags = fcntl(hookserv->socket, F_GETFL, 0)) < 0 ||
+        fcntl(hookserv->socket, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+      retry_connect(hookserv, RECONNECT_INTERVAL);
+      return;
+    }
+  }
+
+  hookserv->reader.done = FALSE;
+  hookserv->reader.thread =
+      g_thread_new("dropbox-hooks", (GThreadFunc)read_hooks, hookserv);
+
+  g_debug("hook client connected");
+  dropbox_stats_add("hooks.connects", 1);
+  DROPBOX_PROBE(connect, "hooks", hookserv->socket_path, 0);
+  hookserv->connected = TRUE;
+  g_hook_list_invoke(&(hookserv->onconnect_hooklist), FALSE);
+}
+
+static gboolean connect_timed_out(CajaDropboxHookserv *hookserv) {
+  g_debug("couldn't connect to hook server after %d ms", CONNECT_TIMEOUT);
+
+  dropbox_watchdog_enter("hooks.connect");
+  hookserv->connect_timeout = 0;
+  retry_connect(hookserv, RECONNECT_INTERVAL);
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+/* the socket became writable, the connect is done one way or another */
+static gboolean connect_ready(GIOChannel *chan, GIOCondition cond,
+                              CajaDropboxHookserv *hookserv) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+
+  dropbox_watchdog_enter("hooks.connect");
+  hookserv->connect_source = 0;
+  g_source_remove(hookserv->connect_timeout);
+  hookserv->connect_timeout = 0;
+
+  if (getsockopt(hookserv->socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+      error != 0) {
+    g_debug("couldn't connect to hook server: %s", g_strerror(error));
+    retry_connect(hookserv, RECONNECT_INTERVAL);
+  } else {
+    finish_connect(hookserv);
+  }
+
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
 static gboolean try_to_connect(CajaDropboxHookserv *hookserv) {
+  dropbox_watchdog_enter("hooks.connect");
+
   /* create socket */
   hookserv->socket = socket(PF_UNIX, SOCK_STREAM, 0);
+  hookserv->chan = NULL;
 
-  /* set native non-blocking, for connect timeout */
+  /* set native non-blocking, this runs on caja's main thread so nothing
+     in here may ever wait for the daemon */
   {
     int flags;
 
-    if ((flags = fcntl(hookserv->socket, F_GETFL, 0)) < 0) {
-      goto FAIL_CLEANUP;
-    }
-
-    if (fcntl(hookserv->socket, F_SETFL, flags | O_NONBLOCK) < 0) {
-      goto FAIL_CLEANUP;
+    if ((flags = fcntl(hookserv->socket, F_GETFL, 0)) < 0 ||
+        fcntl(hookserv->socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+      retry_connect(hookserv, RECONNECT_INTERVAL);
+      dropbox_watchdog_leave();
+      return FALSE;
     }
   }
 
@@ -160,75 +430,29 @@ static gboolean try_to_connect(CajaDropboxHookserv *hookserv) {
 
     /* intialize address structure */
     addr.sun_family = AF_UNIX;
-    g_snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.dropbox/iface_socket",
-               g_get_home_dir());
+    g_strlcpy(addr.sun_path, hookserv->socket_path, sizeof(addr.sun_path));
     addr_len = sizeof(addr) - sizeof(addr.sun_path) + strlen(addr.sun_path);
 
-    /* if there was an error we have to try again later */
-    if (connect(hookserv->socket, (struct sockaddr *)&addr, addr_len) < 0) {
-      if (errno == EINPROGRESS) {
-        fd_set writers;
-        struct timeval tv = {1, 0};
-        FD_ZERO(&writers);
-        FD_SET(hookserv->socket, &writers);
-
-        /* if nothing was ready after 3 seconds, fail out homie */
-        if (select(hookserv->socket + 1, NULL, &writers, NULL, &tv) == 0) {
-          goto FAIL_CLEANUP;
-        }
-
-        if (connect(hookserv->socket, (struct sockaddr *)&addr, addr_len) < 0) {
-          g_debug("couldn't connect to hook server after 1 second");
-          goto FAIL_CLEANUP;
-        }
-      } else {
-        goto FAIL_CLEANUP;
-      }
+    if (connect(hookserv->socket, (struct sockaddr *)&addr, addr_len) == 0) {
+      finish_connect(hookserv);
+    } else if (errno == EINPROGRESS) {
+      /* wait for writability on the main loop instead of in select() */
+      hookserv->chan = g_io_channel_unix_new(hookserv->socket);
+      g_io_channel_set_close_on_unref(hookserv->chan, TRUE);
+      hookserv->connect_source =
+          g_io_add_watch(hookserv->chan, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                         (GIOFunc)connect_ready, hookserv);
+      hookserv->connect_timeout = g_timeout_add(
+          CONNECT_TIMEOUT, (GSourceFunc)connect_timed_out, hookserv);
+    } else if (errno == EAGAIN) {
+      retry_connect(hookserv, RECONNECT_BUSY_INTERVAL);
+    } else {
+      /* if there was an error we have to try again later */
+      retry_connect(hookserv, RECONNECT_INTERVAL);
     }
   }
 
-  /* lol sometimes i write funny codez */
-  if (FALSE) {
-  FAIL_CLEANUP:
-    close(hookserv->socket);
-    g_timeout_add_seconds(1, (GSourceFunc)try_to_connect, hookserv);
-    return FALSE;
-  }
-
-  /* great we connected!, let's create the channel and wait on it */
-  hookserv->chan = g_io_channel_unix_new(hookserv->socket);
-  g_io_channel_set_line_term(hookserv->chan, "\n", -1);
-  g_io_channel_set_close_on_unref(hookserv->chan, TRUE);
-
-  /* Set non-blocking ;) (again just in case) */
-  {
-    GIOFlags flags;
-    GIOStatus iostat;
-
-    flags = g_io_channel_get_flags(hookserv->chan);
-    iostat = g_io_channel_set_flags(hookserv->chan, flags | G_IO_FLAG_NONBLOCK,
-                                    NULL);
-    if (iostat == G_IO_STATUS_ERROR) {
-      g_io_channel_unref(hookserv->chan);
-      g_timeout_add_seconds(1, (GSourceFunc)try_to_connect, hookserv);
-      return FALSE;
-    }
-  }
-
-  /* this is fun, async io watcher */
-  hookserv->hhsi.line = 0;
-  hookserv->hhsi.command_args = NULL;
-  hookserv->hhsi.command_name = NULL;
-  hookserv->event_source =
-      g_io_add_watch_full(hookserv->chan, G_PRIORITY_DEFAULT,
-                          G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                          (GIOFunc)handle_hook_server_input, hookserv,
-                          (GDestroyNotify)watch_killer);
-
-  g_debug("hook client connected");
-  hookserv->connected = TRUE;
-  g_hook_list_invoke(&(hookserv->onconnect_hooklist), FALSE);
-
+  dropbox_watchdog_leave();
   return FALSE;
 }
 
@@ -241,13 +465,9 @@ gboolean caja_dropbox_hooks_force_reconnect(CajaDropboxHookserv *hookserv) {
 
   g_debug("forcing hook to reconnect");
 
-  g_assert(hookserv->event_source >= 0);
-
-  if (hookserv->event_source > 0) {
-    g_source_remove(hookserv->event_source);
-  } else if (hookserv->event_source == 0) {
-    g_debug("event source was zero!!!!!");
-  }
+  /* the reader sees the end of the stream and the main loop takes it
+     from there */
+  shutdown(hookserv->socket, SHUT_RDWR);
 
   return FALSE;
 }
@@ -256,13 +476,29 @@ gboolean caja_dropbox_hooks_is_connected(CajaDropboxHookserv *hookserv) {
   return hookserv->connected;
 }
 
-void caja_dropbox_hooks_setup(CajaDropboxHookserv *hookserv) {
+void caja_dropbox_hooks_setup(CajaDropboxHookserv *hookserv,
+                              const gchar *socket_path) {
+  hookserv->socket_path = g_strdup(socket_path);
   hookserv->dispatch_table = g_hash_table_new_full(
       (GHashFunc)g_str_hash, (GEqualFunc)g_str_equal, g_free, g_free);
   hookserv->connected = FALSE;
+  hookserv->chan = NULL;
+  hookserv->connect_source = 0;
+  hookserv->connect_timeout = 0;
+  g_queue_init(&(hookserv->hhsi.pending));
+  hookserv->hhsi.dispatch_source = 0;
+  hookserv->reader.thread = NULL;
+  g_mutex_init(&(hookserv->reader.mutex));
+  hookserv->reader.batch = g_ptr_array_new();
+  hookserv->reader.seen =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, NULL);
+  hookserv->reader.done = FALSE;
+  hookserv->reader.idle = FALSE;
 
   g_hook_list_init(&(hookserv->ondisconnect_hooklist), sizeof(GHook));
   g_hook_list_init(&(hookserv->onconnect_hooklist), sizeof(GHook));
+  dropbox_recorder_init();
 }
 
 void caja_dropbox_hooks_add_on_disconnect_hook(
@@ -32,22 +32,36 @@ typedef void (*DropboxUpdateHook)(GHashTable *, gpointer);
 typedef void (*DropboxHookClientConnectHook)(gpointer);
 
 typedef struct {
+  gchar *socket_path;
   GIOChannel *chan;
   int socket;
   struct {
-    int line;
-    gchar *command_name;
-    GHashTable *command_args;
-    int numargs;
+    /* parsed messages waiting for their hooks */
+    GQueue pending;
+    guint dispatch_source;
   } hhsi;
+  /* the thread that reads and parses the socket, and what it hands over
+     to the main loop */
+  struct {
+    GThread *thread;
+    GMutex mutex;
+    /* of HookMessage, NULL where a later identical message replaced one */
+    GPtrArray *batch;
+    /* raw message text to its index in batch plus one */
+    GHashTable *seen;
+    gboolean done;
+    gint idle;
+  } reader;
   gboolean connected;
-  guint event_source;
+  /* watch and timeout of a connect in progress */
+  guint connect_source;
+  guint connect_timeout;
   GHashTable *dispatch_table;
   GHookList ondisconnect_hooklist;
   GHookList onconnect_hooklist;
 } CajaDropboxHookserv;
 
-void caja_dropbox_hooks_setup(CajaDropboxHookserv *);
+void caja_dropbox_hooks_setup(CajaDropboxHookserv *, const gchar *socket_path);
 
 void caja_dropbox_hooks_start(CajaDropboxHookserv *);
 
@@ -28,12 +28,16 @@
 #include <ctype.h>
 #include <errno.h>
 #include <glib-object.h>
+#include <glib-unix.h>
 #include <glib.h>
+#include <glib/gi18n-lib.h>
 #include <glib/gprintf.h>
 #include <gtk/gtk.h>
+#include <libcaja-extension/caja-column-provider.h>
 #include <libcaja-extension/caja-extension-types.h>
 #include <libcaja-extension/caja-info-provider.h>
 #include <libcaja-extension/caja-menu-provider.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -41,249 +45,692 @@
 
 #include "caja-dropbox-hooks.h"
 #include "caja-dropbox.h"
+#include "dropbox-client-util.h"
 #include "dropbox-command-client.h"
+#include "dropbox-probes.h"
+#include "dropbox-stats.h"
+#include "dropbox-watchdog.h"
 
 static char *emblems[] = {"dropbox-uptodate", "dropbox-syncing",
                           "dropbox-unsyncable"};
 gchar *DEFAULT_EMBLEM_PATHS[2] = {EMBLEMDIR, NULL};
 
-gboolean dropbox_use_operation_in_progress_workaround;
+/* list view columns, filled from the emblems of the same lookup so the
+   columns never cost the daemon anything extra.  the daemon has no batched
+   status query, that lookup is as batched as it gets */
+#define STATUS_ATTRIBUTE "dropbox_status"
+#define FOLDER_TAG_ATTRIBUTE "dropbox_folder_tag"
+
+static const struct {
+  const gchar *emblem;
+  const gchar *value;
+} status_values[] = {{"dropbox-uptodate", N_("up to date")},
+                     {"dropbox-syncing", N_("syncing")},
+                     {"dropbox-unsyncable", N_("unsyncable")}},
+  folder_tag_values[] = {{"web", N_("public")},
+                         {"people", N_("shared")},
+                         {"photos", N_("photos")},
+                         {"star", N_("sandbox")}};
 
 static GType dropbox_type = 0;
 
 /*
-  Simplifies a path by removing navigation elements such as '.' and '..'
+  Same as dropbox_client_util_canonicalize_path_into but returns a newly
+  allocated string, NULL if the input path is invalid.
+*/
+static gchar *canonicalize_path(const gchar *path) {
+  gchar *toret = g_malloc(strlen(path) + 1);
+
+  if (!dropbox_client_util_canonicalize_path_into(path, toret)) {
+    g_free(toret);
+    return NULL;
+  }
+
+  return toret;
+}
+
+/* how many background revalidations we keep in the command queue at once,
+   so requests for what the user is looking at don't queue behind them */
+#define REVALIDATE_BATCH 32
+
+/*
+  Everything we keep about a file, attached to the CajaFileInfo so it goes
+  away with it.
+
+  cvs is set while the file is tracked, that is while path is the key of
+  its entry in cvs->filename2obj.  path is the canonical UTF-8 path of the
+  file as long as its uri is unchanged.  It is an interned GRefString, so
+  the table uses it as its key without a copy and every file object caja
+  makes for the same path holds a reference to the same string.  The
+  string goes away with the last file object for the path.
+
+  instance is the daemon the file's path was last routed to.  generation
+  is the generation of that instance's DropboxClient the emblems were
+  learned on, anything older is stale and gets revalidated after a
+  reconnect.  fresh
+  is set when a revalidation found new emblems and invalidated the file,
+  the next update_file_info can then answer without asking the daemon.
+  retry is set when caja's lookup was shed from a full command queue, the
+  revalidation pass asks again whatever the generation.  redraw is set
+  when the emblem icons changed, the revalidation pass then invalidates
+  the file even if its emblems are the same.
+*/
+typedef struct {
+  CajaDropbox *cvs;
+  CajaDropboxInstance *instance;
+  gchar *uri;
+  gchar *path;
+  gchar **emblems;
+  guint generation;
+  guint last_seen;
+  guint fresh : 1;
+  guint retry : 1;
+  guint redraw : 1;
+  guint changed_pending : 1;
+} CajaDropboxFileState;
+
+static GQuark file_state_quark;
+
+/* drops the filename2obj entry of a tracked file.  the entry is always
+   its own, track_file() untracks whichever file had the path before. */
+static void forget_file_path(CajaDropboxFileState *state) {
+  g_hash_table_remove(state->cvs->filename2obj, state->path);
+}
+
+static void file_state_free(CajaDropboxFileState *state) {
+  /* the file is being finalized, so its signal handlers are gone already */
+  if (state->cvs != NULL) {
+    forget_file_path(state);
+  }
+
+  g_free(state->uri);
+  if (state->path != NULL) {
+    g_ref_string_release(state->path);
+  }
+  g_strfreev(state->emblems);
+  g_free(state);
+}
+
+static CajaDropboxFileState *get_file_state(CajaFileInfo *file) {
+  return g_object_get_qdata(G_OBJECT(file), file_state_quark);
+}
+
+static CajaDropboxFileState *ensure_file_state(CajaFileInfo *file) {
+  CajaDropboxFileState *state = get_file_state(file);
+
+  if (state == NULL) {
+    state = g_new0(CajaDropboxFileState, 1);
+    g_object_set_qdata_full(G_OBJECT(file), file_state_quark, state,
+                            (GDestroyNotify)file_state_free);
+  }
+
+  return state;
+}
+
+static void changed_cb(CajaFileInfo *file, CajaDropbox *cvs);
+
+static void untrack_file(CajaFileInfo *file, CajaDropboxFileState *state) {
+  if (state == NULL || state->cvs == NULL) {
+    return;
+  }
+
+  forget_file_path(state);
+  g_signal_handlers_disconnect_by_func(file, G_CALLBACK(changed_cb),
+                                       state->cvs);
+  state->cvs = NULL;
+}
+
+/* maps state->path to file, so we can shell touch it later */
+static void track_file(CajaDropbox *cvs, CajaFileInfo *file,
+                       CajaDropboxFileState *state) {
+  CajaFileInfo *f2;
+
+  if ((f2 = g_hash_table_lookup(cvs->filename2obj, state->path)) != NULL &&
+      f2 != file) {
+    /* this happens when caja allocates another file object
+       for a filename without first deleting the original file object
+
+       just remove the association to the older file object, it's
+       obsolete
+    */
+    untrack_file(f2, get_file_state(f2));
+  }
+
+  g_hash_table_replace(cvs->filename2obj, state->path, file);
+
+  if (state->cvs == NULL) {
+    state->cvs = cvs;
+    g_signal_connect(file, "changed", G_CALLBACK(changed_cb), cvs);
+  }
+}
+
+/*
+  Resolves the canonical UTF-8 path of a file, only redoing the work when
+  the file's uri changed since we last looked.  A tracked file is moved to
+  its new path in the filename2obj hash.
 
   Arguments:
-    - path: input path to be canonicalized
+    - file: the file to resolve
+    - invalid: set to TRUE if the file's path is not a valid path
+    - moved: if not NULL, set to TRUE if a tracked file changed its path
 
   Returns:
-    Canonicalized path if input path is valid.
-    NULL otherwise.
+    The path, owned by the file's state, or NULL if the file is not a local
+    file we can hand to Dropbox.
 */
-static gchar *canonicalize_path(gchar *path) {
-  int i, j = 0;
-  gchar *toret = NULL;
-  gchar **cpy, **elts;
-
-  g_assert(path != NULL);
-  g_assert(path[0] == '/');
-
-  elts = g_strsplit(path, "/", 0);
-  cpy = g_new(gchar *, g_strv_length(elts) + 1);
-  cpy[j++] = "/";
-  for (i = 0; elts[i] != NULL; i++) {
-    if (strcmp(elts[i], "..") == 0) {
-      if (j > 0) {
-        j--;
-      } else {
-        // Input path has too many parent directory references and is invalid
-        toret = NULL;
-        goto exit;
-      }
-    } else if (strcmp(elts[i], ".") != 0 && elts[i][0] != '\0') {
-      cpy[j++] = elts[i];
-    }
+static const gchar *get_file_path(CajaFileInfo *file, gboolean *invalid,
+                                  gboolean *moved) {
+  CajaDropboxFileState *state = get_file_state(file);
+  CajaDropbox *cvs;
+  gchar *uri, *pfilename, *utf8_filename;
+
+  *invalid = FALSE;
+  if (moved != NULL) {
+    *moved = FALSE;
   }
 
-  cpy[j] = NULL;
-  toret = g_build_filenamev(cpy);
+  uri = caja_file_info_get_uri(file);
+  if (uri == NULL) {
+    return NULL;
+  }
+
+  if (state != NULL && state->uri != NULL && strcmp(state->uri, uri) == 0) {
+    g_free(uri);
+    return state->path;
+  }
 
-exit:
-  g_free(cpy);
-  g_strfreev(elts);
+  pfilename = g_filename_from_uri(uri, NULL, NULL);
+  if (pfilename == NULL) {
+    g_free(uri);
+    return NULL;
+  }
 
-  return toret;
+  if (!dropbox_client_util_canonicalize_path_into(pfilename, pfilename)) {
+    /* pfilename path was invalid if canonicalize operation rejected it */
+    *invalid = TRUE;
+    g_free(pfilename);
+    g_free(uri);
+    return NULL;
+  }
+
+  utf8_filename = g_filename_to_utf8(pfilename, -1, NULL, NULL, NULL);
+  g_free(pfilename);
+  if (utf8_filename == NULL) {
+    /* oooh, filename wasn't correctly encoded */
+    g_debug("file wasn't correctly encoded %s", uri);
+    g_free(uri);
+    return NULL;
+  }
+
+  state = ensure_file_state(file);
+
+  /* the file is about to move to another key */
+  if ((cvs = state->cvs) != NULL) {
+    forget_file_path(state);
+  }
+
+  g_free(state->uri);
+  if (state->path != NULL) {
+    g_ref_string_release(state->path);
+  }
+  state->uri = uri;
+  state->path = g_ref_string_new_intern(utf8_filename);
+  g_free(utf8_filename);
+
+  if (cvs != NULL) {
+    g_debug("file moved to %s", state->path);
+    track_file(cvs, file, state);
+    if (moved != NULL) {
+      *moved = TRUE;
+    }
+  }
+
+  return state->path;
 }
 
-static void reset_file(CajaFileInfo *file) {
-  g_debug("resetting file %p", (void *)file);
-  caja_file_info_invalidate_extension_info(file);
+/* takes roots as read from info.json */
+static void set_roots(CajaDropboxInstance *inst, gchar **roots) {
+  g_strfreev(inst->roots);
+  inst->roots = roots;
+
+  /* not linked yet, the daemon will default to Dropbox next to its
+     directory, ~/Dropbox for ~/.dropbox */
+  if (inst->roots[0] == NULL) {
+    gchar *home = g_path_get_dirname(inst->dc.socket_dir);
+
+    g_free(inst->roots);
+    inst->roots = g_new(gchar *, 2);
+    inst->roots[0] = g_build_filename(home, "Dropbox", NULL);
+    inst->roots[1] = NULL;
+    g_free(home);
+  }
 }
 
-static gboolean reset_all_files(CajaDropbox *cvs) {
-  /* Only run this on the main loop or you'll cause problems. */
+static void roots_loaded(GFile *info, GAsyncResult *result,
+                         CajaDropboxInstance *inst) {
+  gchar *contents;
 
-  /* this works because you can call a function pointer with
-     more arguments than it takes */
-  g_hash_table_foreach(cvs->obj2filename, (GHFunc)reset_file, NULL);
-  return FALSE;
+  if (g_file_load_contents_finish(info, result, &contents, NULL, NULL,
+                                  NULL)) {
+    set_roots(inst, dropbox_client_util_parse_roots(contents));
+    g_free(contents);
+  } else {
+    set_roots(inst, g_new0(gchar *, 1));
+  }
+  g_debug("roots of %s reloaded", inst->dc.socket_dir);
 }
 
-static void when_file_dies(CajaDropbox *cvs, CajaFileInfo *address) {
+/* somebody linked, unlinked or moved their Dropbox folder */
+static void info_changed(GFileMonitor *monitor, GFile *info, GFile *other,
+                         GFileMonitorEvent event, CajaDropboxInstance *inst) {
+  /* a write is followed by CHANGES_DONE_HINT, wait for that */
+  if (event == G_FILE_MONITOR_EVENT_CHANGED ||
+      event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED) {
+    return;
+  }
+
+  g_file_load_contents_async(info, NULL, (GAsyncReadyCallback)roots_loaded,
+                             inst);
+}
+
+/*
+  Reads the instance's roots.  This once, when caja loads the extension, it
+  reads info.json right away, everything routes on it.  After that a
+  monitor reloads it in the background whenever it changes.
+*/
+static void load_roots(CajaDropboxInstance *inst) {
   gchar *filename;
+  GFile *info;
 
-  filename = g_hash_table_lookup(cvs->obj2filename, address);
+  if (inst->root != NULL) {
+    inst->roots = g_new(gchar *, 2);
+    inst->roots[0] = g_strdup(inst->root);
+    inst->roots[1] = NULL;
+    return;
+  }
+
+  set_roots(inst, dropbox_client_util_read_roots(inst->dc.socket_dir));
+
+  filename = g_build_filename(inst->dc.socket_dir, "info.json", NULL);
+  info = g_file_new_for_path(filename);
+  inst->info_monitor = g_file_monitor_file(info, G_FILE_MONITOR_NONE, NULL,
+                                           NULL);
+  if (inst->info_monitor != NULL) {
+    g_signal_connect(inst->info_monitor, "changed", G_CALLBACK(info_changed),
+                     inst);
+  }
+  g_object_unref(info);
+  g_free(filename);
+}
+
+/* length of the longest of roots that contains path, -1 if none does */
+static gssize match_roots(gchar **roots, const gchar *path) {
+  gssize best = -1;
+  int i;
+
+  for (i = 0; roots[i] != NULL; i++) {
+    size_t len = strlen(roots[i]);
+
+    if (strncmp(path, roots[i], len) == 0 &&
+        (path[len] == '\0' || path[len] == '/' || roots[i][len - 1] == '/') &&
+        (gssize)len > best) {
+      best = len;
+    }
+  }
+
+  return best;
+}
+
+static CajaDropboxInstance *find_instance(CajaDropbox *cvs,
+                                          const gchar *path) {
+  CajaDropboxInstance *found = NULL;
+  gssize best = -1;
+  guint i;
+
+  for (i = 0; i < cvs->instances->len; i++) {
+    CajaDropboxInstance *inst = g_ptr_array_index(cvs->instances, i);
+    gssize len = match_roots(inst->roots, path);
+
+    if (len > best) {
+      best = len;
+      found = inst;
+    }
+  }
+
+  return found;
+}
+
+static void start_client(CajaDropboxInstance *inst) {
+  inst->client_started = TRUE;
+
+  g_debug("about to start client connection to %s", inst->dc.socket_dir);
+  dropbox_client_start(&(inst->dc));
+}
+
+/*
+  Picks the daemon whose Dropbox folder contains path, the one with the
+  longest root if they nest.  A daemon's client and its thread are only
+  started once caja shows us something inside one of its folders.
+
+  Paths under no known root, say through a symlink, go to the first daemon
+  as they always did, but only once that one runs.  Returns NULL if no
+  running daemon is responsible for path.
+*/
+static CajaDropboxInstance *route_path(CajaDropbox *cvs, const gchar *path) {
+  CajaDropboxInstance *inst = find_instance(cvs, path);
 
-  /* we never got a change to view this file */
-  if (filename == NULL) {
+  if (inst == NULL) {
+    inst = g_ptr_array_index(cvs->instances, 0);
+    return inst->client_started ? inst : NULL;
+  }
+
+  if (!inst->client_started) {
+    start_client(inst);
+  }
+
+  return inst;
+}
+
+static gboolean emblems_equal(gchar **a, gchar **b) {
+  int i;
+
+  if (a == NULL || b == NULL) {
+    return a == b;
+  }
+
+  for (i = 0; a[i] != NULL && b[i] != NULL; i++) {
+    if (strcmp(a[i], b[i]) != 0) {
+      return FALSE;
+    }
+  }
+
+  return a[i] == NULL && b[i] == NULL;
+}
+
+static void add_file_emblems(CajaFileInfo *file, gchar **file_emblems) {
+  const gchar *status = "", *tag = "";
+  guint i, j;
+
+  if (file_emblems == NULL) {
     return;
   }
 
-  g_hash_table_remove(cvs->filename2obj, filename);
-  g_hash_table_remove(cvs->obj2filename, address);
+  for (i = 0; file_emblems[i] != NULL; i++) {
+    caja_file_info_add_emblem(file, file_emblems[i]);
+
+    for (j = 0; j < G_N_ELEMENTS(status_values); j++) {
+      if (strcmp(file_emblems[i], status_values[j].emblem) == 0) {
+        status = _(status_values[j].value);
+      }
+    }
+    for (j = 0; j < G_N_ELEMENTS(folder_tag_values); j++) {
+      if (strcmp(file_emblems[i], folder_tag_values[j].emblem) == 0) {
+        tag = _(folder_tag_values[j].value);
+      }
+    }
+  }
+
+  /* the columns sort on these strings */
+  caja_file_info_add_string_attribute(file, STATUS_ATTRIBUTE, status);
+  caja_file_info_add_string_attribute(file, FOLDER_TAG_ATTRIBUTE, tag);
 }
 
-static void changed_cb(CajaFileInfo *file, CajaDropbox *cvs) {
-  /* check if this file's path has changed, if so update the hash and invalidate
-     the file */
-  gchar *filename, *pfilename;
-  gchar *filename2;
-  gchar *uri;
+static void reset_file(CajaFileInfo *file) {
+  CajaDropboxFileState *state;
 
-  uri = caja_file_info_get_uri(file);
-  pfilename = g_filename_from_uri(uri, NULL, NULL);
-  filename = pfilename ? canonicalize_path(pfilename) : NULL;
+  g_debug("resetting file %p", (void *)file);
 
-  /* Canonicalization will only null-out a non-null filename if it is invalid */
-  g_assert((pfilename == NULL && filename == NULL) ||
-           (pfilename != NULL && filename != NULL));
+  /* whatever we learned in the background is outdated now */
+  if ((state = get_file_state(file)) != NULL) {
+    state->fresh = FALSE;
+  }
 
-  filename2 = g_hash_table_lookup(cvs->obj2filename, file);
+  caja_file_info_invalidate_extension_info(file);
+}
 
-  g_free(pfilename);
-  g_free(uri);
+static void check_file_location(CajaFileInfo *file, CajaDropbox *cvs) {
+  /* check if this file's path has changed, if so update the hash and invalidate
+     the file */
+  CajaDropboxFileState *state = get_file_state(file);
+  gboolean invalid, moved;
 
-  /* if filename2 is NULL we've never seen this file in update_file_info */
-  if (filename2 == NULL) {
-    g_free(filename);
+  /* we've never seen this file in update_file_info */
+  if (state == NULL || state->cvs == NULL) {
     return;
   }
 
-  if (filename == NULL) {
+  if (get_file_path(file, &invalid, &moved) == NULL) {
     /* A file has moved to offline storage. Lets remove it from our tables. */
-    g_object_weak_unref(G_OBJECT(file), (GWeakNotify)when_file_dies, cvs);
-    g_hash_table_remove(cvs->filename2obj, filename2);
-    g_hash_table_remove(cvs->obj2filename, file);
-    g_signal_handlers_disconnect_by_func(file, G_CALLBACK(changed_cb), cvs);
+    cvs->changed_moves++;
+    untrack_file(file, state);
     reset_file(file);
     return;
   }
 
   /* this is a hack, because caja doesn't do this for us, for some reason
      the file's path has changed */
-  if (strcmp(filename, filename2) != 0) {
-    g_debug("shifty old: %s, new %s", filename2, filename);
+  if (moved) {
+    cvs->changed_moves++;
+    reset_file(file);
+  }
+}
 
-    /* gotta do this first, the call after this frees filename2 */
-    g_hash_table_remove(cvs->filename2obj, filename2);
+static gboolean check_changed_files(CajaDropbox *cvs) {
+  gint64 start = g_get_monotonic_time();
+  guint i;
 
-    g_hash_table_replace(cvs->obj2filename, file, g_strdup(filename));
+  dropbox_watchdog_enter("changed.check");
+  cvs->changed_source = 0;
 
-    {
-      CajaFileInfo *f2;
-      /* we shouldn't have another mapping from filename to an object */
-      f2 = g_hash_table_lookup(cvs->filename2obj, filename);
-      if (f2 != NULL) {
-        /* lets fix it if it's true, just remove the mapping */
-        g_hash_table_remove(cvs->filename2obj, filename);
-        g_hash_table_remove(cvs->obj2filename, f2);
-      }
+  for (i = 0; i < cvs->changed_files->len; i++) {
+    CajaFileInfo *file = g_ptr_array_index(cvs->changed_files, i);
+    CajaDropboxFileState *state = get_file_state(file);
+
+    if (state != NULL) {
+      state->changed_pending = FALSE;
     }
+    check_file_location(file, cvs);
+    cvs->changed_checks++;
+    g_object_unref(file);
+  }
+  g_ptr_array_set_size(cvs->changed_files, 0);
 
-    g_hash_table_insert(cvs->filename2obj, g_strdup(filename), file);
-    reset_file(file);
+  cvs->changed_time += g_get_monotonic_time() - start;
+  g_debug("changed: %u signals, %u checks, %u moves, %" G_GINT64_FORMAT " us",
+          cvs->changed_signals, cvs->changed_checks, cvs->changed_moves,
+          cvs->changed_time);
+
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+static void changed_cb(CajaFileInfo *file, CajaDropbox *cvs) {
+  /* caja emits changed for every invalidation and emblem update as well, so
+     only note the file here and check its location once things settle, a
+     file that changes a hundred times before then is checked once */
+  gint64 start = g_get_monotonic_time();
+  CajaDropboxFileState *state = get_file_state(file);
+
+  dropbox_watchdog_enter("changed");
+  cvs->changed_signals++;
+
+  if (state != NULL && !state->changed_pending) {
+    state->changed_pending = TRUE;
+    g_ptr_array_add(cvs->changed_files, g_object_ref(file));
+
+    if (cvs->changed_source == 0) {
+      cvs->changed_source = g_idle_add((GSourceFunc)check_changed_files, cvs);
+    }
   }
 
-  g_free(filename);
+  cvs->changed_time += g_get_monotonic_time() - start;
+  dropbox_watchdog_leave();
 }
 
-static CajaOperationResult caja_dropbox_update_file_info(
-    CajaInfoProvider *provider, CajaFileInfo *file, GClosure *update_complete,
-    CajaOperationHandle **handle) {
+/* a file info lookup on behalf of caja, the handle we give it */
+typedef struct {
+  DropboxFileInfoCommand dfic;
+  CajaInfoProvider *provider;
+  CajaDropboxInstance *instance;
+  GClosure *update_complete;
+  CajaFileInfo *file;
+  gboolean cancelled;
+  /* background check after a reconnect, nobody waits on update_complete */
+  gboolean revalidate;
+} CajaDropboxFileInfoRequest;
+
+static void finish_file_info_command(DropboxFileInfoCommandResponse *dficr);
+
+static CajaOperationResult update_file_info(CajaInfoProvider *provider,
+                                            CajaFileInfo *file,
+                                            GClosure *update_complete,
+                                            CajaOperationHandle **handle) {
   CajaDropbox *cvs;
+  CajaDropboxInstance *inst;
 
   cvs = CAJA_DROPBOX(provider);
 
-  /* this code adds this file object to our two-way hash of file objects
+  /* this code adds this file object to our hash of file objects
      so we can shell touch these files later */
   {
-    gchar *pfilename, *uri;
+    gboolean invalid;
+    const gchar *path;
+    CajaDropboxFileState *state;
 
-    uri = caja_file_info_get_uri(file);
-    pfilename = g_filename_from_uri(uri, NULL, NULL);
-    g_free(uri);
-    if (pfilename == NULL) {
+    if ((path = get_file_path(file, &invalid, NULL)) == NULL) {
+      untrack_file(file, get_file_state(file));
+      return invalid ? CAJA_OPERATION_FAILED : CAJA_OPERATION_COMPLETE;
+    }
+
+    if ((inst = route_path(cvs, path)) == NULL) {
       return CAJA_OPERATION_COMPLETE;
-    } else {
-      int cmp = 0;
-      gchar *stored_filename;
-      gchar *filename;
-
-      filename = canonicalize_path(pfilename);
-      g_free(pfilename);
-      if (filename == NULL) {
-        /* pfilename path was invalid if canonicalize operation nulled it out */
-        return CAJA_OPERATION_FAILED;
-      }
-      stored_filename = g_hash_table_lookup(cvs->obj2filename, file);
-
-      /* don't worry about the dup checks, gcc is smart enough to optimize this
-         GCSE ftw */
-      if ((stored_filename != NULL &&
-           (cmp = strcmp(stored_filename, filename)) != 0) ||
-          stored_filename == NULL) {
-        if (stored_filename != NULL && cmp != 0) {
-          /* this happens when the filename changes name on a file obj
-             but changed_cb isn't called */
-          g_object_weak_unref(G_OBJECT(file), (GWeakNotify)when_file_dies, cvs);
-          g_hash_table_remove(cvs->obj2filename, file);
-          g_hash_table_remove(cvs->filename2obj, stored_filename);
-          g_signal_handlers_disconnect_by_func(file, G_CALLBACK(changed_cb),
-                                               cvs);
-        } else if (stored_filename == NULL) {
-          CajaFileInfo *f2;
-
-          if ((f2 = g_hash_table_lookup(cvs->filename2obj, filename)) != NULL) {
-            /* if the filename exists in the filename2obj hash
-               but the file obj doesn't exist in the obj2filename hash:
-
-               this happens when caja allocates another file object
-               for a filename without first deleting the original file object
-
-               just remove the association to the older file object, it's
-               obsolete
-            */
-            g_object_weak_unref(G_OBJECT(f2), (GWeakNotify)when_file_dies, cvs);
-            g_signal_handlers_disconnect_by_func(f2, G_CALLBACK(changed_cb),
-                                                 cvs);
-            g_hash_table_remove(cvs->filename2obj, filename);
-            g_hash_table_remove(cvs->obj2filename, f2);
-          }
-        }
-
-        g_object_weak_ref(G_OBJECT(file), (GWeakNotify)when_file_dies, cvs);
-        g_hash_table_insert(cvs->filename2obj, g_strdup(filename), file);
-        g_hash_table_insert(cvs->obj2filename, file, g_strdup(filename));
-        g_signal_connect(file, "changed", G_CALLBACK(changed_cb), cvs);
-      }
+    }
 
-      g_free(filename);
+    state = get_file_state(file);
+    if (state->cvs == NULL) {
+      track_file(cvs, file, state);
+    }
+
+    /* what another daemon told us about it doesn't count */
+    if (state->instance != inst) {
+      state->instance = inst;
+      state->fresh = FALSE;
     }
   }
 
-  if (dropbox_client_is_connected(&(cvs->dc)) == FALSE ||
-      caja_file_info_is_gone(file)) {
+  if (caja_file_info_is_gone(file)) {
     return CAJA_OPERATION_COMPLETE;
   }
 
   {
-    DropboxFileInfoCommand *dfic = g_new0(DropboxFileInfoCommand, 1);
+    CajaDropboxFileState *state = get_file_state(file);
+
+    if (state != NULL) {
+      state->last_seen = g_get_monotonic_time() / G_USEC_PER_SEC;
+
+      /* while the daemon is away keep showing the last known emblems,
+         they are stale and will be revalidated once it is back */
+      if (dropbox_client_is_connected(&(inst->dc)) == FALSE ||
+          (state->fresh && state->generation == inst->dc.generation)) {
+        dropbox_stats_add(state->fresh ? "emblem_cache.hits"
+                                       : "emblem_cache.stale",
+                          1);
+        state->fresh = FALSE;
+        add_file_emblems(file, state->emblems);
+        return CAJA_OPERATION_COMPLETE;
+      }
+    }
+  }
 
-    dfic->cancelled = FALSE;
-    dfic->provider = provider;
-    dfic->dc.request_type = GET_FILE_INFO;
-    dfic->update_complete = g_closure_ref(update_complete);
-    dfic->file = g_object_ref(file);
+  if (dropbox_client_is_connected(&(inst->dc)) == FALSE) {
+    return CAJA_OPERATION_COMPLETE;
+  }
 
-    dropbox_command_client_request(&(cvs->dc.dcc), (DropboxCommand *)dfic);
+  {
+    CajaDropboxFileInfoRequest *req = g_new0(CajaDropboxFileInfoRequest, 1);
+
+    dropbox_stats_add("emblem_cache.misses", 1);
+    req->dfic.dc.request_type = GET_FILE_INFO;
+    req->dfic.path = g_strdup(get_file_state(file)->path);
+    req->dfic.is_dir = caja_file_info_is_directory(file);
+    req->dfic.handler = finish_file_info_command;
+    req->cancelled = FALSE;
+    req->provider = provider;
+    req->instance = inst;
+    req->update_complete = g_closure_ref(update_complete);
+    req->file = g_object_ref(file);
+
+    dropbox_command_client_request(&(inst->dc.dcc), (DropboxCommand *)req);
+
+    *handle = (CajaOperationHandle *)req;
+
+    /* caja waits for update_complete before it redraws the file, so it
+       shows up once with its final emblems */
+    return CAJA_OPERATION_IN_PROGRESS;
+  }
+}
+
+/*
+  The options the daemon offers depend on what kind of files are selected
+  and in which folder, not on the exact files.  Returns the key they are
+  cached under, or NULL if the selection spans several folders.
+*/
+static gchar *selection_shape(gchar **paths, GList *files) {
+  gboolean dirs = FALSE, others = FALSE;
+  gchar *parent = NULL, *shape;
+  int i;
 
-    *handle = (CajaOperationHandle *)dfic;
+  for (i = 0; paths[i] != NULL; i++, files = files->next) {
+    gchar *dir = g_path_get_dirname(paths[i]);
 
-    return dropbox_use_operation_in_progress_workaround
-               ? CAJA_OPERATION_COMPLETE
-               : CAJA_OPERATION_IN_PROGRESS;
+    if (parent == NULL) {
+      parent = dir;
+    } else if (strcmp(parent, dir) != 0) {
+      g_free(dir);
+      g_free(parent);
+      return NULL;
+    } else {
+      g_free(dir);
+    }
+
+    if (caja_file_info_is_directory(files->data)) {
+      dirs = TRUE;
+    } else {
+      others = TRUE;
+    }
   }
+
+  shape = g_strdup_printf("%s %s\t%s", i > 1 ? "many" : "one",
+                          dirs && others ? "mixed" : dirs ? "folders" : "files",
+                          parent);
+  g_free(parent);
+  return shape;
+}
+
+static gboolean shape_in_folder(gchar *shape, gchar **options,
+                                const gchar *folder) {
+  return strcmp(strchr(shape, '\t') + 1, folder) == 0;
+}
+
+static void forget_selection_options(CajaDropbox *cvs) {
+  g_free(cvs->selection_paths);
+  g_strfreev(cvs->selection_options);
+  cvs->selection_paths = NULL;
+  cvs->selection_options = NULL;
+}
+
+/* a file changed, the options for selections next to it or inside it may
+   have changed with it */
+static void invalidate_context_options(CajaDropbox *cvs, const gchar *path) {
+  gchar *dir = g_path_get_dirname(path);
+
+  cvs->context_options_epoch++;
+  forget_selection_options(cvs);
+  g_hash_table_foreach_remove(cvs->context_options, (GHRFunc)shape_in_folder,
+                              dir);
+  g_hash_table_foreach_remove(cvs->context_options, (GHRFunc)shape_in_folder,
+                              (gpointer)path);
+  g_free(dir);
 }
 
 static void handle_shell_touch(GHashTable *args, CajaDropbox *cvs) {
@@ -295,6 +742,8 @@ static void handle_shell_touch(GHashTable *args, CajaDropbox *cvs) {
       CajaFileInfo *file;
 
       g_debug("shell touch for %s", filename);
+      invalidate_context_options(cvs, filename);
+
       file = g_hash_table_lookup(cvs->filename2obj, filename);
       if (file != NULL) {
         g_debug("gonna reset %s", filename);
@@ -307,74 +756,248 @@ static void handle_shell_touch(GHashTable *args, CajaDropbox *cvs) {
   return;
 }
 
-gboolean caja_dropbox_finish_file_info_command(
-    DropboxFileInfoCommandResponse *dficr) {
-  CajaOperationResult result = CAJA_OPERATION_FAILED;
+/*
+  Works out the emblems a file info response asks for.
+
+  Returns a NULL terminated list of emblem names, empty if the file has none,
+  or NULL if the daemon didn't give us a usable answer.
+*/
+static gchar **emblems_from_response(DropboxFileInfoCommandResponse *dficr) {
+  GPtrArray *file_emblems;
+  gchar **status = NULL;
+  gboolean isdir;
 
-  if (!dficr->dfic->cancelled) {
-    gchar **status = NULL;
-    gboolean isdir;
+  isdir = dficr->dfic->is_dir;
 
-    isdir = caja_file_info_is_directory(dficr->dfic->file);
+  /* if we have emblems just use them. */
+  if (dficr->emblems_response != NULL &&
+      (status = g_hash_table_lookup(dficr->emblems_response, "emblems")) !=
+          NULL) {
+    int i;
 
-    /* if we have emblems just use them. */
-    if (dficr->emblems_response != NULL &&
-        (status = g_hash_table_lookup(dficr->emblems_response, "emblems")) !=
-            NULL) {
-      int i;
-      for (i = 0; status[i] != NULL; i++) {
-        if (status[i][0])
-          caja_file_info_add_emblem(dficr->dfic->file, status[i]);
+    file_emblems = g_ptr_array_new();
+    for (i = 0; status[i] != NULL; i++) {
+      if (status[i][0]) g_ptr_array_add(file_emblems, g_strdup(status[i]));
+    }
+  }
+  /* if the file status command went okay */
+  else if ((dficr->file_status_response != NULL &&
+            (status = g_hash_table_lookup(dficr->file_status_response,
+                                          "status")) != NULL) &&
+           ((isdir == TRUE && dficr->folder_tag_response != NULL) ||
+            isdir == FALSE)) {
+    gchar **tag = NULL;
+
+    file_emblems = g_ptr_array_new();
+
+    /* set the tag emblem */
+    if (isdir && (tag = g_hash_table_lookup(dficr->folder_tag_response,
+                                            "tag")) != NULL) {
+      if (strcmp("public", tag[0]) == 0) {
+        g_ptr_array_add(file_emblems, g_strdup("web"));
+      } else if (strcmp("shared", tag[0]) == 0) {
+        g_ptr_array_add(file_emblems, g_strdup("people"));
+      } else if (strcmp("photos", tag[0]) == 0) {
+        g_ptr_array_add(file_emblems, g_strdup("photos"));
+      } else if (strcmp("sandbox", tag[0]) == 0) {
+        g_ptr_array_add(file_emblems, g_strdup("star"));
       }
-      result = CAJA_OPERATION_COMPLETE;
     }
-    /* if the file status command went okay */
-    else if ((dficr->file_status_response != NULL &&
-              (status = g_hash_table_lookup(dficr->file_status_response,
-                                            "status")) != NULL) &&
-             ((isdir == TRUE && dficr->folder_tag_response != NULL) ||
-              isdir == FALSE)) {
-      gchar **tag = NULL;
-
-      /* set the tag emblem */
-      if (isdir && (tag = g_hash_table_lookup(dficr->folder_tag_response,
-                                              "tag")) != NULL) {
-        if (strcmp("public", tag[0]) == 0) {
-          caja_file_info_add_emblem(dficr->dfic->file, "web");
-        } else if (strcmp("shared", tag[0]) == 0) {
-          caja_file_info_add_emblem(dficr->dfic->file, "people");
-        } else if (strcmp("photos", tag[0]) == 0) {
-          caja_file_info_add_emblem(dficr->dfic->file, "photos");
-        } else if (strcmp("sandbox", tag[0]) == 0) {
-          caja_file_info_add_emblem(dficr->dfic->file, "star");
-        }
+
+    /* set the status emblem */
+    {
+      int emblem_code = 0;
+
+      if (strcmp("up to date", status[0]) == 0) {
+        emblem_code = 1;
+      } else if (strcmp("syncing", status[0]) == 0) {
+        emblem_code = 2;
+      } else if (strcmp("unsyncable", status[0]) == 0) {
+        emblem_code = 3;
       }
 
-      /* set the status emblem */
-      {
-        int emblem_code = 0;
-
-        if (strcmp("up to date", status[0]) == 0) {
-          emblem_code = 1;
-        } else if (strcmp("syncing", status[0]) == 0) {
-          emblem_code = 2;
-        } else if (strcmp("unsyncable", status[0]) == 0) {
-          emblem_code = 3;
-        }
-
-        if (emblem_code > 0)
-          caja_file_info_add_emblem(dficr->dfic->file,
-                                    emblems[emblem_code - 1]);
+      if (emblem_code > 0)
+        g_ptr_array_add(file_emblems, g_strdup(emblems[emblem_code - 1]));
+    }
+  } else {
+    return NULL;
+  }
+
+  g_ptr_array_add(file_emblems, NULL);
+  return (gchar **)g_ptr_array_free(file_emblems, FALSE);
+}
+
+static gboolean revalidate_some_files(CajaDropboxInstance *inst);
+
+static void schedule_revalidation(CajaDropboxInstance *inst) {
+  if (inst->revalidate_source == 0 &&
+      !g_queue_is_empty(&(inst->revalidate_queue))) {
+    inst->revalidate_source = g_idle_add_full(
+        G_PRIORITY_LOW, (GSourceFunc)revalidate_some_files, inst, NULL);
+  }
+}
+
+static gboolean revalidate_some_files(CajaDropboxInstance *inst) {
+  CajaFileInfo *file;
+
+  inst->revalidate_source = 0;
+
+  if (dropbox_client_is_connected(&(inst->dc)) == FALSE) {
+    return FALSE;
+  }
+
+  dropbox_watchdog_enter("revalidate");
+  while (inst->revalidate_in_flight < REVALIDATE_BATCH &&
+         (file = g_queue_pop_head(&(inst->revalidate_queue))) != NULL) {
+    CajaDropboxFileState *state = get_file_state(file);
+    CajaDropboxFileInfoRequest *req;
+
+    /* it might have been looked at again since we queued it */
+    if (caja_file_info_is_gone(file) || state == NULL || state->path == NULL ||
+        state->instance != inst ||
+        (state->generation == inst->dc.generation && !state->retry)) {
+      g_object_unref(file);
+      continue;
+    }
+
+    req = g_new0(CajaDropboxFileInfoRequest, 1);
+    req->dfic.dc.request_type = GET_FILE_INFO;
+    req->dfic.path = g_strdup(state->path);
+    req->dfic.is_dir = caja_file_info_is_directory(file);
+    req->dfic.background = TRUE;
+    req->dfic.handler = finish_file_info_command;
+    req->cancelled = FALSE;
+    req->revalidate = TRUE;
+    req->provider = CAJA_INFO_PROVIDER(inst->cvs);
+    req->instance = inst;
+    req->update_complete = NULL;
+    req->file = file;
+
+    inst->revalidate_in_flight++;
+    dropbox_command_client_request(&(inst->dc.dcc), (DropboxCommand *)req);
+  }
+  dropbox_watchdog_leave();
+
+  return FALSE;
+}
+
+static gint compare_last_seen(CajaFileInfo *a, CajaFileInfo *b) {
+  CajaDropboxFileState *sa = get_file_state(a), *sb = get_file_state(b);
+  guint la = sa != NULL ? sa->last_seen : 0;
+  guint lb = sb != NULL ? sb->last_seen : 0;
+
+  return la > lb ? -1 : la < lb ? 1 : 0;
+}
+
+static void clear_revalidation(CajaDropboxInstance *inst) {
+  CajaFileInfo *file;
+
+  if (inst->revalidate_source != 0) {
+    g_source_remove(inst->revalidate_source);
+    inst->revalidate_source = 0;
+  }
+
+  while ((file = g_queue_pop_head(&(inst->revalidate_queue))) != NULL) {
+    g_object_unref(file);
+  }
+}
+
+static gboolean start_revalidation(CajaDropboxInstance *inst) {
+  /* Only run this on the main loop or you'll cause problems. */
+  GList *files, *li;
+
+  clear_revalidation(inst);
+
+  /* check the files the user saw last first, they're most likely the ones
+     still on screen */
+  files = g_hash_table_get_values(inst->cvs->filename2obj);
+  files = g_list_sort(files, (GCompareFunc)compare_last_seen);
+  for (li = files; li != NULL; li = g_list_next(li)) {
+    CajaDropboxFileState *state = get_file_state(li->data);
+
+    if (state != NULL && state->instance == inst &&
+        (state->generation != inst->dc.generation || state->retry)) {
+      g_queue_push_tail(&(inst->revalidate_queue), g_object_ref(li->data));
+    }
+  }
+  g_list_free(files);
+
+  g_debug("revalidating %u files for %s",
+          g_queue_get_length(&(inst->revalidate_queue)), inst->dc.socket_dir);
+  schedule_revalidation(inst);
+
+  return FALSE;
+}
+
+/* caja's lookup of the file was shed, the revalidation pass asks again
+   and invalidates it if the answer differs from what it shows now */
+static void retry_file(CajaDropboxInstance *inst, CajaFileInfo *file) {
+  CajaDropboxFileState *state = get_file_state(file);
+
+  if (state == NULL || state->retry) {
+    return;
+  }
+
+  state->retry = TRUE;
+  g_queue_push_tail(&(inst->revalidate_queue), g_object_ref(file));
+  schedule_revalidation(inst);
+}
+
+static void finish_file_info_command(DropboxFileInfoCommandResponse *dficr) {
+  CajaOperationResult result = CAJA_OPERATION_FAILED;
+  CajaDropboxFileInfoRequest *req = (CajaDropboxFileInfoRequest *)dficr->dfic;
+  CajaDropboxInstance *inst = req->instance;
+
+  if (!req->cancelled && req->dfic.shed && !req->revalidate) {
+    CajaDropboxFileState *state = get_file_state(req->file);
+
+    /* the queue was full, not an answer from the daemon.  show what we
+       knew and have the file looked at again once there is room */
+    add_file_emblems(req->file, state != NULL ? state->emblems : NULL);
+    retry_file(inst, req->file);
+    result = CAJA_OPERATION_COMPLETE;
+  } else if (!req->cancelled) {
+    gchar **file_emblems = emblems_from_response(dficr);
+
+    if (file_emblems != NULL) {
+      CajaDropboxFileState *state = ensure_file_state(req->file);
+
+      gboolean changed = !emblems_equal(state->emblems, file_emblems);
+
+      g_strfreev(state->emblems);
+      state->emblems = file_emblems;
+      state->instance = inst;
+      state->generation = inst->dc.generation;
+      state->retry = FALSE;
+
+      if (!req->revalidate) {
+        add_file_emblems(req->file, file_emblems);
+      } else if (changed || state->redraw) {
+        /* only bother caja about files whose emblems really changed, or
+           whose icons did */
+        reset_file(req->file);
+        state->fresh = TRUE;
       }
+      state->redraw = FALSE;
       result = CAJA_OPERATION_COMPLETE;
     }
   }
 
   /* complete the info request */
-  if (!dropbox_use_operation_in_progress_workaround) {
+  if (req->revalidate) {
+    CajaDropboxFileState *state = get_file_state(req->file);
+
+    /* shed again, the next shed lookup of caja's queues it anew */
+    if (req->dfic.shed && state != NULL) {
+      state->retry = FALSE;
+    }
+    inst->revalidate_in_flight--;
+    schedule_revalidation(inst);
+  } else if (!req->cancelled) {
+    /* caja has forgotten about cancelled handles, don't confuse it */
     caja_info_provider_update_complete_invoke(
-        dficr->dfic->update_complete, dficr->dfic->provider,
-        (CajaOperationHandle *)dficr->dfic, result);
+        req->update_complete, req->provider, (CajaOperationHandle *)req,
+        result);
   }
 
   /* destroy the objects we created */
@@ -386,28 +1009,33 @@ gboolean caja_dropbox_finish_file_info_command(
     g_hash_table_unref(dficr->emblems_response);
 
   /* unref the objects we didn't create */
-  g_closure_unref(dficr->dfic->update_complete);
-  g_object_unref(dficr->dfic->file);
+  if (req->update_complete != NULL) g_closure_unref(req->update_complete);
+  g_object_unref(req->file);
 
   /* now free the structs */
-  g_free(dficr->dfic);
+  g_free(req->dfic.path);
+  g_free(req);
   g_free(dficr);
-
-  return FALSE;
 }
 
 static void caja_dropbox_cancel_update(CajaInfoProvider *provider,
                                        CajaOperationHandle *handle) {
-  DropboxFileInfoCommand *dfic = (DropboxFileInfoCommand *)handle;
-  dfic->cancelled = TRUE;
+  CajaDropboxFileInfoRequest *req = (CajaDropboxFileInfoRequest *)handle;
+  dropbox_watchdog_enter("cancel_update");
+  req->cancelled = TRUE;
+  DROPBOX_PROBE(request__cancel, "file_info", req->dfic.path,
+                req->dfic.dc.id);
+  dropbox_watchdog_leave();
   return;
 }
 
 static void menu_item_cb(CajaMenuItem *item, CajaDropbox *cvs) {
+  CajaDropboxInstance *inst;
   gchar *verb;
   GList *files;
   DropboxGeneralCommand *dcac;
 
+  dropbox_watchdog_enter("menu_item");
   dcac = g_new(DropboxGeneralCommand, 1);
 
   /* maybe these would be better passed in a container
@@ -429,12 +1057,13 @@ static void menu_item_cb(CajaMenuItem *item, CajaDropbox *cvs) {
 
     arglist = g_new0(gchar *, g_list_length(files) + 1);
 
+    /* get_file_items already looked these up */
     for (li = files, i = 0; li != NULL; li = g_list_next(li)) {
-      char *uri = caja_file_info_get_uri(CAJA_FILE_INFO(li->data));
-      char *path = g_filename_from_uri(uri, NULL, NULL);
-      g_free(uri);
+      gboolean invalid;
+      const gchar *path =
+          get_file_path(CAJA_FILE_INFO(li->data), &invalid, NULL);
       if (!path) continue;
-      arglist[i] = path;
+      arglist[i] = g_strdup(path);
       i++;
     }
 
@@ -453,7 +1082,21 @@ static void menu_item_cb(CajaMenuItem *item, CajaDropbox *cvs) {
   dcac->handler = NULL;
   dcac->handler_ud = NULL;
 
-  dropbox_command_client_request(&(cvs->dc.dcc), (DropboxCommand *)dcac);
+  {
+    gchar **paths = g_hash_table_lookup(dcac->command_args, "paths");
+
+    /* the daemon that offered the action */
+    if (paths[0] == NULL || (inst = route_path(cvs, paths[0])) == NULL) {
+      g_hash_table_unref(dcac->command_args);
+      g_free(dcac->command_name);
+      g_free(dcac);
+      dropbox_watchdog_leave();
+      return;
+    }
+  }
+
+  dropbox_command_client_request(&(inst->dc.dcc), (DropboxCommand *)dcac);
+  dropbox_watchdog_leave();
 }
 
 #define XDIGIT(c) ((c) <= '9' ? (c) - '0' : ((c) & 0x4F) - 'A' + 10)
@@ -488,10 +1131,38 @@ static int GhettoURLDecode(gchar *out, gchar *in, int n) {
   return -1;
 }
 
-static int caja_dropbox_parse_menu(gchar **options, CajaMenu *menu,
-                                   GString *old_action_string, GList *toret,
-                                   CajaMenuProvider *provider, GList *files) {
-  int ret = 0;
+/* a context menu entry as parsed from the daemon's option strings */
+typedef struct {
+  gchar *action;
+  gchar *label;
+  gchar *tooltip;
+  gchar *verb;         /* NULL for submenus */
+  gboolean grayed_out;
+  GPtrArray *children; /* of DropboxMenuNode, submenus only */
+} DropboxMenuNode;
+
+/* the daemon only ever sends a handful of different option lists */
+#define MENU_TREES_MAX 32
+#define CONTEXT_OPTIONS_MAX 64
+
+static void menu_node_free(DropboxMenuNode *node) {
+  g_free(node->action);
+  g_free(node->label);
+  g_free(node->tooltip);
+  g_free(node->verb);
+  if (node->children != NULL) g_ptr_array_unref(node->children);
+  g_free(node);
+}
+
+/* menus without any items are remembered as NULL */
+static void menu_nodes_free(GPtrArray *nodes) {
+  if (nodes != NULL) g_ptr_array_unref(nodes);
+}
+
+static GPtrArray *parse_menu_nodes(gchar **options,
+                                   const gchar *action_prefix, int *leaves) {
+  GPtrArray *nodes =
+      g_ptr_array_new_with_free_func((GDestroyNotify)menu_node_free);
   int i;
 
   for (i = 0; options[i] != NULL; i++) {
@@ -506,6 +1177,7 @@ static int caja_dropbox_parse_menu(gchar **options, CajaMenu *menu,
     gchar *item_name = option_info[0];
     gchar *item_inner = option_info[1];
     gchar *verb = option_info[2];
+    DropboxMenuNode *node = g_new0(DropboxMenuNode, 1);
 
     GhettoURLDecode(item_name, item_name, strlen(item_name));
     GhettoURLDecode(verb, verb, strlen(verb));
@@ -515,80 +1187,175 @@ static int caja_dropbox_parse_menu(gchar **options, CajaMenu *menu,
     // will be ignored. Otherwise add the verb to our map and add the menu item
     // to the list.
     if (strchr(item_inner, '~') != NULL) {
-      GString *new_action_string = g_string_new(old_action_string->str);
       gchar **suboptions = g_strsplit(item_inner, "|", -1);
-      CajaMenuItem *item;
-      CajaMenu *submenu = caja_menu_new();
-
-      g_string_append(new_action_string, item_name);
-      g_string_append(new_action_string, "::");
 
-      ret += caja_dropbox_parse_menu(suboptions, submenu, new_action_string,
-                                     toret, provider, files);
-
-      item = caja_menu_item_new(new_action_string->str, item_name, "", NULL);
-      caja_menu_item_set_submenu(item, submenu);
-      caja_menu_append_item(menu, item);
+      node->action = g_strconcat(action_prefix, item_name, "::", NULL);
+      node->label = g_strdup(item_name);
+      node->tooltip = g_strdup("");
+      node->children = parse_menu_nodes(suboptions, node->action, leaves);
 
       g_strfreev(suboptions);
-      g_object_unref(item);
-      g_object_unref(submenu);
-      g_string_free(new_action_string, TRUE);
     } else {
-      CajaMenuItem *item;
-      GString *new_action_string = g_string_new(old_action_string->str);
-      gboolean grayed_out = FALSE;
-
-      g_string_append(new_action_string, verb);
+      node->action = g_strconcat(action_prefix, verb, NULL);
 
       if (item_name[0] == '!') {
         item_name++;
-        grayed_out = TRUE;
+        node->grayed_out = TRUE;
       }
 
-      item = caja_menu_item_new(new_action_string->str, item_name, item_inner,
-                                NULL);
+      node->label = g_strdup(item_name);
+      node->tooltip = g_strdup(item_inner);
+      node->verb = g_strdup(verb);
+      (*leaves)++;
+    }
+
+    g_ptr_array_add(nodes, node);
+    g_strfreev(option_info);
+  }
+  return nodes;
+}
+
+/* parsed menus are remembered by their raw option strings, returns NULL
+   when there is nothing to show */
+static GPtrArray *get_menu_nodes(CajaDropbox *cvs, gchar **options) {
+  gchar *raw = g_strjoinv("\n", options);
+  GPtrArray *nodes;
+
+  if (!g_hash_table_lookup_extended(cvs->menu_trees, raw, NULL,
+                                    (gpointer *)&nodes)) {
+    int leaves = 0;
+
+    nodes = parse_menu_nodes(options, "CajaDropbox::", &leaves);
+    if (leaves == 0) {
+      g_ptr_array_unref(nodes);
+      nodes = NULL;
+    }
+
+    if (g_hash_table_size(cvs->menu_trees) >= MENU_TREES_MAX) {
+      g_hash_table_remove_all(cvs->menu_trees);
+    }
+    g_hash_table_insert(cvs->menu_trees, raw, nodes);
+  } else {
+    g_free(raw);
+  }
+
+  return nodes;
+}
+
+static void build_menu(GPtrArray *nodes, CajaMenu *menu,
+                       CajaMenuProvider *provider, GList *files) {
+  guint i;
+
+  for (i = 0; i < nodes->len; i++) {
+    DropboxMenuNode *node = g_ptr_array_index(nodes, i);
+    CajaMenuItem *item;
+
+    item = caja_menu_item_new(node->action, node->label, node->tooltip, NULL);
 
-      caja_menu_append_item(menu, item);
+    if (node->children != NULL) {
+      CajaMenu *submenu = caja_menu_new();
+
+      build_menu(node->children, submenu, provider, files);
+      caja_menu_item_set_submenu(item, submenu);
+      g_object_unref(submenu);
+    } else {
       /* add the file metadata to this item */
       g_object_set_data_full(G_OBJECT(item), "caja_dropbox_files",
                              caja_file_info_list_copy(files),
                              (GDestroyNotify)caja_file_info_list_free);
       /* add the verb metadata */
       g_object_set_data_full(G_OBJECT(item), "caja_dropbox_verb",
-                             g_strdup(verb), (GDestroyNotify)g_free);
+                             g_strdup(node->verb), (GDestroyNotify)g_free);
       g_signal_connect(item, "activate", G_CALLBACK(menu_item_cb), provider);
 
-      if (grayed_out) {
+      if (node->grayed_out) {
         GValue sensitive = {0};
         g_value_init(&sensitive, G_TYPE_BOOLEAN);
         g_value_set_boolean(&sensitive, FALSE);
         g_object_set_property(G_OBJECT(item), "sensitive", &sensitive);
       }
+    }
 
-      g_object_unref(item);
-      g_string_free(new_action_string, TRUE);
-      ret++;
+    caja_menu_append_item(menu, item);
+    g_object_unref(item);
+  }
+}
+
+typedef struct {
+  CajaDropbox *cvs;
+  gchar *shape;
+  /* the paths of a selection without a shape, when nobody waits */
+  gchar *selection;
+  guint epoch;
+  GAsyncQueue *reply_queue; /* NULL when nobody is waiting */
+  /* caja got no menu for lack of options, ask it again once they're in */
+  gboolean refresh;
+  GHashTable *response;
+} ContextOptionsRequest;
+
+static gboolean store_context_options(ContextOptionsRequest *req) {
+  /* Only run this on the main loop or you'll cause problems. */
+  CajaDropbox *cvs = req->cvs;
+  gchar **options = g_hash_table_lookup(req->response, "options");
+
+  dropbox_watchdog_enter("context_options.store");
+
+  /* drop answers that raced with a shell touch */
+  if (options != NULL && req->epoch == cvs->context_options_epoch) {
+    if (req->shape != NULL) {
+      if (g_hash_table_size(cvs->context_options) >= CONTEXT_OPTIONS_MAX) {
+        g_hash_table_remove_all(cvs->context_options);
+      }
+      g_hash_table_replace(cvs->context_options, req->shape,
+                           g_strdupv(options));
+      req->shape = NULL;
+    } else {
+      forget_selection_options(cvs);
+      cvs->selection_paths = req->selection;
+      cvs->selection_options = g_strdupv(options);
+      req->selection = NULL;
+    }
+
+    if (req->refresh) {
+      caja_menu_provider_emit_items_updated_signal(CAJA_MENU_PROVIDER(cvs));
     }
-    g_strfreev(option_info);
   }
-  return ret;
+
+  g_hash_table_unref(req->response);
+  g_free(req->shape);
+  g_free(req->selection);
+  g_free(req);
+  dropbox_watchdog_leave();
+  return FALSE;
 }
 
-static void get_file_items_callback(GHashTable *response, gpointer ud) {
-  GAsyncQueue *reply_queue = ud;
+static void get_file_items_callback(GHashTable *response,
+                                    ContextOptionsRequest *req) {
+  if (req->reply_queue != NULL) {
+    /* queue_push doesn't accept NULL as a value so we create an empty hash
+     * table if we got no response. */
+    g_async_queue_push(req->reply_queue,
+                       response ? g_hash_table_ref(response)
+                                : g_hash_table_new((GHashFunc)g_str_hash,
+                                                   (GEqualFunc)g_str_equal));
+    g_async_queue_unref(req->reply_queue);
+  }
 
-  /* queue_push doesn't accept NULL as a value so we create an empty hash table
-   * if we got no response. */
-  g_async_queue_push(reply_queue,
-                     response ? g_hash_table_ref(response)
-                              : g_hash_table_new((GHashFunc)g_str_hash,
-                                                 (GEqualFunc)g_str_equal));
-  g_async_queue_unref(reply_queue);
+  /* with the threaded client this is the command thread and the cache
+     lives on the main loop.  the main loop client calls this from the
+     main loop already, the idle only keeps one way for both */
+  if (response != NULL && (req->shape != NULL || req->selection != NULL)) {
+    req->response = g_hash_table_ref(response);
+    g_idle_add((GSourceFunc)store_context_options, req);
+  } else {
+    g_free(req->shape);
+    g_free(req->selection);
+    g_free(req);
+  }
 }
 
-static GList *caja_dropbox_get_file_items(CajaMenuProvider *provider,
-                                          GtkWidget *window, GList *files) {
+static GList *get_file_items(CajaMenuProvider *provider, GtkWidget *window,
+                             GList *files) {
   /*
    * 1. Convert files to filenames.
    */
@@ -600,15 +1367,11 @@ static GList *caja_dropbox_get_file_items(CajaMenuProvider *provider,
   int i = 0;
   GList *elem;
 
+  /* the paths are cached on the files, update_file_info has usually
+     converted them already */
   for (elem = files; elem; elem = elem->next, i++) {
-    gchar *uri = caja_file_info_get_uri(elem->data);
-    gchar *filename_un = uri ? g_filename_from_uri(uri, NULL, NULL) : NULL;
-    gchar *filename =
-        filename_un ? g_filename_to_utf8(filename_un, -1, NULL, NULL, NULL)
-                    : NULL;
-
-    g_free(uri);
-    g_free(filename_un);
+    gboolean invalid;
+    const gchar *filename = get_file_path(elem->data, &invalid, NULL);
 
     if (filename == NULL) {
       /* oooh, filename wasn't correctly encoded, or isn't a local file.  */
@@ -616,14 +1379,65 @@ static GList *caja_dropbox_get_file_items(CajaMenuProvider *provider,
       return NULL;
     }
 
-    paths[i] = filename;
+    paths[i] = g_strdup(filename);
   }
 
-  GAsyncQueue *reply_queue =
-      g_async_queue_new_full((GDestroyNotify)g_hash_table_unref);
+  CajaDropbox *cvs = CAJA_DROPBOX(provider);
+  CajaDropboxInstance *inst = NULL;
+
+  /* nothing in a Dropbox folder, and no client to ask anyway */
+  for (i = 0; paths[i] != NULL; i++) {
+    if ((inst = route_path(cvs, paths[i])) != NULL) {
+      break;
+    }
+  }
+  if (inst == NULL) {
+    g_strfreev(paths);
+    return NULL;
+  }
+
+  /*
+   * 2. Look for options we got for the same kind of selection before.
+   */
+
+  ContextOptionsRequest *req = g_new0(ContextOptionsRequest, 1);
+  req->cvs = cvs;
+  req->shape = selection_shape(paths, files);
+  req->epoch = cvs->context_options_epoch;
+
+  gchar **options =
+      req->shape ? g_hash_table_lookup(cvs->context_options, req->shape) : NULL;
+  GAsyncQueue *reply_queue = NULL;
+
+#ifdef MAINLOOP_COMMAND_CLIENT
+  if (req->shape == NULL) {
+    req->selection = g_strjoinv("\n", paths);
+    if (cvs->selection_paths != NULL &&
+        strcmp(cvs->selection_paths, req->selection) == 0) {
+      options = cvs->selection_options;
+    }
+  }
+#endif
+
+  dropbox_stats_add(options != NULL ? "context_options.hits"
+                                    : "context_options.misses",
+                    1);
+
+  if (options == NULL) {
+#ifdef MAINLOOP_COMMAND_CLIENT
+    /* the reply is read on this very thread, waiting for it here would
+       only ever time out.  no menu this time, caja asks again once the
+       options are in */
+    req->refresh = TRUE;
+#else
+    reply_queue = g_async_queue_new_full((GDestroyNotify)g_hash_table_unref);
+    req->reply_queue = g_async_queue_ref(reply_queue);
+#endif
+  }
 
   /*
-   * 2. Create a DropboxGeneralCommand to call "icon_overlay_context_options"
+   * 3. Create a DropboxGeneralCommand to call "icon_overlay_context_options",
+   *    with cached options it only refreshes the cache in the background.
    */
 
   DropboxGeneralCommand *dgc = g_new0(DropboxGeneralCommand, 1);
@@ -633,37 +1447,43 @@ static GList *caja_dropbox_get_file_items(CajaMenuProvider *provider,
       g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
                             (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
   g_hash_table_insert(dgc->command_args, g_strdup("paths"), paths);
-  dgc->handler = get_file_items_callback;
-  dgc->handler_ud = g_async_queue_ref(reply_queue);
+  dgc->handler = (CajaDropboxCommandResponseHandler)get_file_items_callback;
+  dgc->handler_ud = req;
 
   /*
-   * 3. Queue it up for the helper thread to run it.
+   * 4. Queue it up for the command client to run it.
    */
-  CajaDropbox *cvs = CAJA_DROPBOX(provider);
-  dropbox_command_client_request(&(cvs->dc.dcc), (DropboxCommand *)dgc);
+  dropbox_command_client_request(&(inst->dc.dcc), (DropboxCommand *)dgc);
 
   /*
-   * 4. We have to block until it's done because caja expects a reply.  But we
-   * will only block for 50 ms for a reply.
+   * 5. Without cached options we have to block until it's done because caja
+   * expects a reply.  But we will only block for 50 ms for a reply.  The
+   * main loop client doesn't get here, see above.
    */
 
-  GHashTable *context_options_response =
-      g_async_queue_timeout_pop(reply_queue, 50000);
-  g_async_queue_unref(reply_queue);
+  GHashTable *context_options_response = NULL;
 
-  if (!context_options_response) {
-    return NULL;
+  if (reply_queue != NULL) {
+    context_options_response = g_async_queue_timeout_pop(reply_queue, 50000);
+    g_async_queue_unref(reply_queue);
+
+    if (!context_options_response) {
+      dropbox_stats_add("context_options.timeouts", 1);
+      return NULL;
+    }
+
+    options = g_hash_table_lookup(context_options_response, "options");
   }
 
   /*
-   * 5. Parse the reply.
+   * 6. Build the menu from the (memoized) parsed options.
    */
 
-  char **options = g_hash_table_lookup(context_options_response, "options");
   GList *toret = NULL;
+  GPtrArray *nodes;
 
-  if (options && *options && **options) {
-    /* build the menu */
+  if (options && *options && **options &&
+      (nodes = get_menu_nodes(cvs, options)) != NULL) {
     CajaMenuItem *root_item;
     CajaMenu *root_menu;
 
@@ -671,134 +1491,276 @@ static GList *caja_dropbox_get_file_items(CajaMenuProvider *provider,
     root_item = caja_menu_item_new("CajaDropbox::root_item", "Dropbox",
                                    "Dropbox Options", "dropbox");
 
-    toret = g_list_append(toret, root_item);
-    GString *action_string = g_string_new("CajaDropbox::");
-
-    if (!caja_dropbox_parse_menu(options, root_menu, action_string, toret,
-                                 provider, files)) {
-      g_object_unref(toret);
-      toret = NULL;
-    }
-
+    build_menu(nodes, root_menu, provider, files);
     caja_menu_item_set_submenu(root_item, root_menu);
+    toret = g_list_append(toret, root_item);
 
-    g_string_free(action_string, TRUE);
     g_object_unref(root_menu);
   }
 
-  g_hash_table_unref(context_options_response);
+  if (context_options_response != NULL) {
+    g_hash_table_unref(context_options_response);
+  }
 
   return toret;
 }
 
-static gboolean add_emblem_paths(GHashTable *emblem_paths_response) {
-  gchar **emblem_paths_list;
+/* swaps the old emblem paths for the new ones in a single search path
+   update, everything else on the search path stays where it was */
+static void set_theme_emblem_paths(CajaDropboxInstance *inst,
+                                   gchar **old_paths, gchar **new_paths) {
+  GtkIconTheme *theme = gtk_icon_theme_get_default();
+  GHashTable *drop, *seen;
+  GPtrArray *search_path;
+  gchar **paths;
+  gint path_count, i;
+  guint j;
 
-  /* Only run this on the main loop or you'll cause problems. */
-  if (!emblem_paths_response) return FALSE;
+  drop = g_hash_table_new((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal);
+  seen = g_hash_table_new((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal);
 
-  if (NULL != (emblem_paths_list = g_hash_table_lookup(emblem_paths_response,
-                                                       "path"))) {
-    GtkIconTheme *theme = gtk_icon_theme_get_default();
-    int i;
+  for (i = 0; old_paths != NULL && old_paths[i] != NULL; i++) {
+    g_hash_table_add(drop, old_paths[i]);
+  }
+  for (i = 0; new_paths[i] != NULL; i++) {
+    g_hash_table_remove(drop, new_paths[i]);
+  }
+  /* other daemons may still need them */
+  for (j = 0; j < inst->cvs->instances->len; j++) {
+    CajaDropboxInstance *other = g_ptr_array_index(inst->cvs->instances, j);
+
+    for (i = 0; other != inst && other->emblem_paths != NULL &&
+                other->emblem_paths[i] != NULL;
+         i++) {
+      g_hash_table_remove(drop, other->emblem_paths[i]);
+    }
+  }
+
+  gtk_icon_theme_get_search_path(theme, &paths, &path_count);
 
-    for (i = 0; emblem_paths_list[i] != NULL; i++) {
-      if (emblem_paths_list[i][0])
-        gtk_icon_theme_append_search_path(theme, emblem_paths_list[i]);
+  search_path = g_ptr_array_new();
+  for (i = 0; i < path_count; i++) {
+    if (!g_hash_table_contains(drop, paths[i]) &&
+        g_hash_table_add(seen, paths[i])) {
+      g_ptr_array_add(search_path, paths[i]);
+    }
+  }
+  for (i = 0; new_paths[i] != NULL; i++) {
+    if (g_hash_table_add(seen, new_paths[i])) {
+      g_ptr_array_add(search_path, new_paths[i]);
+    }
+  }
+
+  gtk_icon_theme_set_search_path(theme, (const gchar **)search_path->pdata,
+                                 search_path->len);
+
+  g_ptr_array_free(search_path, TRUE);
+  g_strfreev(paths);
+  g_hash_table_destroy(seen);
+  g_hash_table_destroy(drop);
+}
+
+/* only files that show our emblems care about where they come from.  the
+   revalidation pass that follows looks each of them up once and redraws
+   it with the new icons */
+static void redraw_emblemed_files(CajaDropboxInstance *inst) {
+  GHashTableIter iter;
+  CajaFileInfo *file;
+
+  g_hash_table_iter_init(&iter, inst->cvs->filename2obj);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&file)) {
+    CajaDropboxFileState *state = get_file_state(file);
+
+    if (state != NULL && state->instance == inst && state->emblems != NULL &&
+        state->emblems[0] != NULL) {
+      state->retry = TRUE;
+      state->redraw = TRUE;
     }
   }
-  g_hash_table_unref(emblem_paths_response);
-  return FALSE;
 }
 
-static gboolean remove_emblem_paths(GHashTable *emblem_paths_response) {
+static gboolean apply_emblem_paths(CajaDropboxInstance *inst) {
   /* Only run this on the main loop or you'll cause problems. */
-  if (!emblem_paths_response) return FALSE;
+  gchar **new_paths;
 
-  gchar **emblem_paths_list =
-      g_hash_table_lookup(emblem_paths_response, "path");
-  if (!emblem_paths_list) goto exit;
+  g_mutex_lock(&(inst->emblem_paths_mutex));
+  new_paths = inst->pending_emblem_paths;
+  inst->pending_emblem_paths = NULL;
+  inst->emblem_paths_source = 0;
+  g_mutex_unlock(&(inst->emblem_paths_mutex));
 
-  // We need to remove the old paths.
-  GtkIconTheme *icon_theme = gtk_icon_theme_get_default();
-  gchar **paths;
-  gint path_count;
+  if (new_paths == NULL) {
+    return FALSE;
+  }
 
-  gtk_icon_theme_get_search_path(icon_theme, &paths, &path_count);
+  dropbox_watchdog_enter("emblem_paths");
 
-  gint i, j, out = 0;
-  gboolean found = FALSE;
-  for (i = 0; i < path_count; i++) {
-    gboolean keep = TRUE;
-    for (j = 0; emblem_paths_list[j] != NULL; j++) {
-      if (emblem_paths_list[j][0]) {
-        if (!g_strcmp0(paths[i], emblem_paths_list[j])) {
-          found = TRUE;
-          keep = FALSE;
-          g_free(paths[i]);
-          break;
-        }
-      }
-    }
-    if (keep) {
-      paths[out] = paths[i];
-      out++;
+  /* a daemon restart usually hands us the very same paths again, that
+     must not make gtk rescan the theme */
+  if (!emblems_equal(inst->emblem_paths, new_paths)) {
+    g_debug("emblem paths changed");
+    set_theme_emblem_paths(inst, inst->emblem_paths, new_paths);
+    g_strfreev(inst->emblem_paths);
+    inst->emblem_paths = new_paths;
+    redraw_emblemed_files(inst);
+  } else {
+    g_strfreev(new_paths);
+  }
+
+  start_revalidation(inst);
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+static void get_emblem_paths_cb(GHashTable *emblem_paths_response,
+                                CajaDropboxInstance *inst) {
+  gchar **emblem_paths_list = NULL;
+  GPtrArray *new_paths;
+  int i;
+
+  if (emblem_paths_response != NULL) {
+    emblem_paths_list = g_hash_table_lookup(emblem_paths_response, "path");
+  }
+  if (emblem_paths_list == NULL) {
+    emblem_paths_list = DEFAULT_EMBLEM_PATHS;
+  }
+
+  new_paths = g_ptr_array_new();
+  for (i = 0; emblem_paths_list[i] != NULL; i++) {
+    if (emblem_paths_list[i][0]) {
+      g_ptr_array_add(new_paths, g_strdup(emblem_paths_list[i]));
     }
   }
+  g_ptr_array_add(new_paths, NULL);
+
+  /* only the latest answer matters, one idle applies it */
+  g_mutex_lock(&(inst->emblem_paths_mutex));
+  g_strfreev(inst->pending_emblem_paths);
+  inst->pending_emblem_paths = (gchar **)g_ptr_array_free(new_paths, FALSE);
+  if (inst->emblem_paths_source == 0) {
+    inst->emblem_paths_source =
+        g_idle_add((GSourceFunc)apply_emblem_paths, inst);
+  }
+  g_mutex_unlock(&(inst->emblem_paths_mutex));
+}
+
+static void on_connect(CajaDropboxInstance *inst) {
+  /* files keep their emblems from the last connection until they have been
+     revalidated, which starts once the emblem paths are back in place */
+  dropbox_command_client_send_command(
+      &(inst->dc.dcc), (CajaDropboxCommandResponseHandler)get_emblem_paths_cb,
+      inst, "get_emblem_paths", NULL);
+}
 
-  /* If we found one we need to reset the path to
-     accomodate the changes */
-  if (found) {
-    paths[out] = NULL; /* Clear the last one */
-    gtk_icon_theme_set_search_path(icon_theme, (const gchar **)paths, out);
+static void on_disconnect(CajaDropboxInstance *inst) {
+  /* keep the emblems and their search paths around, a restarting daemon
+     shouldn't make everything blink.  They are stale from now on. */
+  clear_revalidation(inst);
+
+  /* the next daemon may well offer different things */
+  inst->cvs->context_options_epoch++;
+  g_hash_table_remove_all(inst->cvs->context_options);
+  forget_selection_options(inst->cvs);
+}
+
+static void add_instance(CajaDropbox *cvs, const gchar *socket_dir,
+                         const gchar *root) {
+  CajaDropboxInstance *inst = g_new0(CajaDropboxInstance, 1);
+
+  inst->cvs = cvs;
+  /* canonicalize_path only takes absolute paths, a bad root is left out
+     and the daemon's info.json is read instead */
+  if (root != NULL && g_path_is_absolute(root)) {
+    inst->root = canonicalize_path(root);
   }
+  if (root != NULL && inst->root == NULL) {
+    g_warning("ignoring Dropbox folder %s of %s, it is not a valid "
+              "absolute path",
+              root, socket_dir);
+  }
+  inst->client_started = FALSE;
+  g_mutex_init(&(inst->emblem_paths_mutex));
+  g_queue_init(&(inst->revalidate_queue));
 
-  g_strfreev(paths);
-exit:
-  g_hash_table_unref(emblem_paths_response);
-  return FALSE;
+  /* setup the connection obj*/
+  dropbox_client_setup(&(inst->dc), socket_dir);
+
+  /* our hooks */
+  caja_dropbox_hooks_add(&(inst->dc.hookserv), "shell_touch",
+                         (DropboxUpdateHook)handle_shell_touch, cvs);
+
+  /* add connection handlers */
+  dropbox_client_add_on_connect_hook(
+      &(inst->dc), (DropboxClientConnectHook)on_connect, inst);
+  dropbox_client_add_on_disconnect_hook(
+      &(inst->dc), (DropboxClientConnectHook)on_disconnect, inst);
+
+  g_ptr_array_add(cvs->instances, inst);
 }
 
-static void get_emblem_paths_cb(GHashTable *emblem_paths_response,
-                                CajaDropbox *cvs) {
-  if (!emblem_paths_response) {
-    emblem_paths_response =
-        g_hash_table_new((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal);
-    g_hash_table_insert(emblem_paths_response, "path", DEFAULT_EMBLEM_PATHS);
-  } else {
-    /* Increase the ref so that finish_general_command doesn't delete it. */
-    g_hash_table_ref(emblem_paths_response);
+/*
+  CAJA_DROPBOX_INSTANCES lists the directories of the daemons to talk to,
+  separated like $PATH.  An entry of the form dir=root names the daemon's
+  Dropbox folder, otherwise it is read from dir/info.json.  The default is
+  the one daemon in ~/.dropbox.
+*/
+static void setup_instances(CajaDropbox *cvs) {
+  const gchar *config = g_getenv("CAJA_DROPBOX_INSTANCES");
+  guint i;
+
+  cvs->instances = g_ptr_array_new();
+
+  if (config != NULL) {
+    gchar **entries = g_strsplit(config, G_SEARCHPATH_SEPARATOR_S, -1);
+
+    for (i = 0; entries[i] != NULL; i++) {
+      gchar **dir_root = g_strsplit(entries[i], "=", 2);
+
+      if (dir_root[0] != NULL && g_path_is_absolute(dir_root[0])) {
+        add_instance(cvs, dir_root[0],
+                     dir_root[1] != NULL && dir_root[1][0] ? dir_root[1]
+                                                           : NULL);
+      }
+      g_strfreev(dir_root);
+    }
+    g_strfreev(entries);
   }
 
-  g_mutex_lock(&(cvs->emblem_paths_mutex));
-  if (cvs->emblem_paths) {
-    g_idle_add((GSourceFunc)remove_emblem_paths, cvs->emblem_paths);
-    cvs->emblem_paths = NULL;
+  if (cvs->instances->len == 0) {
+    gchar *dropbox_dir =
+        g_build_filename(g_get_home_dir(), ".dropbox", NULL);
+
+    add_instance(cvs, dropbox_dir, NULL);
+    g_free(dropbox_dir);
   }
-  cvs->emblem_paths = emblem_paths_response;
-  g_mutex_unlock(&(cvs->emblem_paths_mutex));
 
-  g_idle_add((GSourceFunc)add_emblem_paths,
-             g_hash_table_ref(emblem_paths_response));
-  g_idle_add((GSourceFunc)reset_all_files, cvs);
+  for (i = 0; i < cvs->instances->len; i++) {
+    load_roots(g_ptr_array_index(cvs->instances, i));
+  }
 }
 
-static void on_connect(CajaDropbox *cvs) {
-  reset_all_files(cvs);
+/* what caja calls directly, bracketed for the watchdog */
+static CajaOperationResult caja_dropbox_update_file_info(
+    CajaInfoProvider *provider, CajaFileInfo *file, GClosure *update_complete,
+    CajaOperationHandle **handle) {
+  CajaOperationResult result;
+
+  dropbox_watchdog_enter("update_file_info");
+  result = update_file_info(provider, file, update_complete, handle);
+  dropbox_watchdog_leave();
 
-  dropbox_command_client_send_command(
-      &(cvs->dc.dcc), (CajaDropboxCommandResponseHandler)get_emblem_paths_cb,
-      cvs, "get_emblem_paths", NULL);
+  return result;
 }
 
-static void on_disconnect(CajaDropbox *cvs) {
-  reset_all_files(cvs);
+static GList *caja_dropbox_get_file_items(CajaMenuProvider *provider,
+                                          GtkWidget *window, GList *files) {
+  GList *items;
+
+  dropbox_watchdog_enter("get_file_items");
+  items = get_file_items(provider, window, files);
+  dropbox_watchdog_leave();
 
-  g_mutex_lock(&(cvs->emblem_paths_mutex));
-  /* This call will free the data too. */
-  g_idle_add((GSourceFunc)remove_emblem_paths, cvs->emblem_paths);
-  cvs->emblem_paths = NULL;
-  g_mutex_unlock(&(cvs->emblem_paths_mutex));
+  return items;
 }
 
 static void caja_dropbox_menu_provider_iface_init(
@@ -814,37 +1776,87 @@ static void caja_dropbox_info_provider_iface_init(
   return;
 }
 
+static GList *caja_dropbox_get_columns(CajaColumnProvider *provider) {
+  GList *columns = NULL;
+
+  columns = g_list_append(
+      columns,
+      caja_column_new("CajaDropbox::status_column", STATUS_ATTRIBUTE,
+                      _("Dropbox status"),
+                      _("Sync status of the file in Dropbox")));
+  columns = g_list_append(
+      columns, caja_column_new("CajaDropbox::folder_tag_column",
+                               FOLDER_TAG_ATTRIBUTE, _("Dropbox folder"),
+                               _("Whether the folder is public or shared")));
+
+  return columns;
+}
+
+static void caja_dropbox_column_provider_iface_init(
+    CajaColumnProviderIface *iface) {
+  iface->get_columns = caja_dropbox_get_columns;
+  return;
+}
+
 static void caja_dropbox_instance_init(CajaDropbox *cvs) {
+  /* keys are the paths of the files' CajaDropboxFileState */
   cvs->filename2obj =
+      g_hash_table_new((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal);
+  cvs->changed_files = g_ptr_array_new();
+  cvs->changed_source = 0;
+  cvs->changed_signals = cvs->changed_checks = cvs->changed_moves = 0;
+  cvs->changed_time = 0;
+  cvs->menu_trees =
       g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
-                            (GDestroyNotify)g_free, (GDestroyNotify)NULL);
-  cvs->obj2filename = g_hash_table_new_full(
-      (GHashFunc)g_direct_hash, (GEqualFunc)g_direct_equal,
-      (GDestroyNotify)NULL, (GDestroyNotify)g_free);
-  g_mutex_init(&(cvs->emblem_paths_mutex));
-  cvs->emblem_paths = NULL;
-
-  /* setup the connection obj*/
-  dropbox_client_setup(&(cvs->dc));
+                            g_free, (GDestroyNotify)menu_nodes_free);
+  cvs->context_options =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            g_free, (GDestroyNotify)g_strfreev);
+  cvs->context_options_epoch = 0;
+  cvs->selection_paths = NULL;
+  cvs->selection_options = NULL;
 
-  /* our hooks */
-  caja_dropbox_hooks_add(&(cvs->dc.hookserv), "shell_touch",
-                         (DropboxUpdateHook)handle_shell_touch, cvs);
+  setup_instances(cvs);
 
-  /* add connection handlers */
-  dropbox_client_add_on_connect_hook(&(cvs->dc),
-                                     (DropboxClientConnectHook)on_connect, cvs);
-  dropbox_client_add_on_disconnect_hook(
-      &(cvs->dc), (DropboxClientConnectHook)on_disconnect, cvs);
+  /* the connections start with the first file inside a Dropbox folder,
+     unless asked to start right away */
+  if (g_getenv("CAJA_DROPBOX_EAGER_START") != NULL) {
+    guint i;
 
-  /* now start the connection */
-  g_debug("about to start client connection");
-  dropbox_client_start(&(cvs->dc));
+    for (i = 0; i < cvs->instances->len; i++) {
+      start_client(g_ptr_array_index(cvs->instances, i));
+    }
+  }
 
   return;
 }
 
-static void caja_dropbox_class_init(CajaDropboxClass *class) {}
+/* kill -USR2 <caja pid> writes the counters and latencies, when asked for
+   with CAJA_DROPBOX_STATS_SIGNAL */
+static gboolean dump_stats(gpointer data) {
+  GError *error = NULL;
+  gchar *filename;
+
+  if ((filename = dropbox_stats_dump(&error)) != NULL) {
+    g_debug("stats written to %s", filename);
+    g_free(filename);
+  } else {
+    g_debug("couldn't write stats: %s", error->message);
+    g_error_free(error);
+  }
+
+  return TRUE;
+}
+
+static void caja_dropbox_class_init(CajaDropboxClass *class) {
+  file_state_quark = g_quark_from_static_string("caja-dropbox-file-state");
+  dropbox_watchdog_init();
+
+  /* SIGUSR2 belongs to caja, don't take it unless asked to */
+  if (g_getenv("CAJA_DROPBOX_STATS_SIGNAL") != NULL) {
+    g_unix_signal_add(SIGUSR2, dump_stats, NULL);
+  }
+}
 
 static void caja_dropbox_class_finalize(CajaDropboxClass *class) {
 }
@@ -870,6 +1882,9 @@ void caja_dropbox_register_type(GTypeModule *module) {
   static const GInterfaceInfo info_provider_iface_info = {
       (GInterfaceInitFunc)caja_dropbox_info_provider_iface_init, NULL, NULL};
 
+  static const GInterfaceInfo column_provider_iface_info = {
+      (GInterfaceInitFunc)caja_dropbox_column_provider_iface_init, NULL, NULL};
+
   dropbox_type = g_type_module_register_type(module, G_TYPE_OBJECT,
                                              "CajaDropbox", &info, 0);
 
@@ -878,4 +1893,7 @@ void caja_dropbox_register_type(GTypeModule *module) {
 
   g_type_module_add_interface(module, dropbox_type, CAJA_TYPE_INFO_PROVIDER,
                               &info_provider_iface_info);
+
+  g_type_module_add_interface(module, dropbox_type, CAJA_TYPE_COLUMN_PROVIDER,
+                              &column_provider_iface_info);
 }
@@ -24,6 +24,7 @@
 #ifndef CAJA_DROPBOX_H
 #define CAJA_DROPBOX_H
 
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 #include <libcaja-extension/caja-info-provider.h>
@@ -45,13 +46,47 @@ G_BEGIN_DECLS
 typedef struct _CajaDropbox CajaDropbox;
 typedef struct _CajaDropboxClass CajaDropboxClass;
 
+/* one Dropbox daemon and the folders it syncs */
+typedef struct {
+  CajaDropbox *cvs;
+  DropboxClient dc;
+  /* configured Dropbox folder, NULL to read them from info.json */
+  gchar *root;
+  gchar **roots;
+  /* reloads roots when info.json changes, if root is NULL */
+  GFileMonitor *info_monitor;
+  gboolean client_started;
+  /* emblem paths on the icon theme search path, main loop only */
+  gchar **emblem_paths;
+  /* latest daemon answer waiting for the main loop */
+  GMutex emblem_paths_mutex;
+  gchar **pending_emblem_paths;
+  guint emblem_paths_source;
+  GQueue revalidate_queue;
+  guint revalidate_in_flight;
+  guint revalidate_source;
+} CajaDropboxInstance;
+
 struct _CajaDropbox {
   GObject parent_slot;
   GHashTable *filename2obj;
-  GHashTable *obj2filename;
-  GMutex emblem_paths_mutex;
-  GHashTable *emblem_paths;
-  DropboxClient dc;
+  /* of CajaDropboxInstance, the first one gets paths outside every root */
+  GPtrArray *instances;
+  GPtrArray *changed_files;
+  guint changed_source;
+  guint changed_signals;
+  guint changed_checks;
+  guint changed_moves;
+  gint64 changed_time;
+  /* parsed context menus by raw option strings */
+  GHashTable *menu_trees;
+  /* context options by selection shape, main loop only */
+  GHashTable *context_options;
+  guint context_options_epoch;
+  /* the options for the last selection without a shape, for the menu
+     refresh that follows its answer when we can't wait for it */
+  gchar *selection_paths;
+  gchar **selection_options;
 };
 
 struct _CajaDropboxClass {
@@ -61,10 +96,6 @@ struct _CajaDropboxClass {
 GType caja_dropbox_get_type(void);
 void caja_dropbox_register_type(GTypeModule *module);
 
-extern gboolean dropbox_use_operation_in_progress_workaround;
-
-gboolean caja_dropbox_finish_file_info_command(DropboxFileInfoCommandResponse *dficr);
-
 G_END_DECLS
 
 #endif
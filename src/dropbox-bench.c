@@ -0,0 +1,202 @@
+/*
+ * dropbox-bench.c
+ * Times file info lookups through the command client, and info.json reads.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  dropbox-bench [OPTION...] COMMAND_SOCKET
+
+  Connects the command client this tree was configured with (threaded,
+  or the main loop one with --enable-mainloop-command-client) to
+  COMMAND_SOCKET and runs --lookups file info lookups through it, at most
+  --window of them queued at a time.  A window of 1 gives the latency of
+  one lookup, a big one the throughput.  It prints the time from queueing
+  a lookup to its handler running on the main loop.
+
+  bench-command-client.sh runs it against fake-dropboxd.
+
+  dropbox-bench --info-json DIR [--lookups N]
+
+  Reads and parses DIR/info.json N times, the way the extension finds the
+  Dropbox folders, and prints how long one read took.  That is what every
+  lookup used to pay on the main loop once the roots were older than ten
+  seconds.  Now info.json is watched and only read, asynchronously, when
+  it changes, so lookups pay nothing for it.
+*/
+
+#include <glib.h>
+#include <stdlib.h>
+
+#include "dropbox-client-util.h"
+#include "dropbox-command-client.h"
+
+typedef struct {
+  DropboxFileInfoCommand dfic;
+  gint64 start;
+} BenchLookup;
+
+static gint lookups = 2000;
+static gint window = 1;
+static gchar *info_dir;
+
+static DropboxCommandClient dcc;
+static GMainLoop *main_loop;
+static gint sent;
+static gint done;
+static gint64 bench_start;
+/* of gint64, microseconds per lookup */
+static GArray *times;
+
+static GOptionEntry entries[] = {
+    {"lookups", 'n', 0, G_OPTION_ARG_INT, &lookups,
+     "How many lookups to run (default 2000)", "N"},
+    {"window", 'w', 0, G_OPTION_ARG_INT, &window,
+     "How many may be queued at a time (default 1)", "N"},
+    {"info-json", 'i', 0, G_OPTION_ARG_FILENAME, &info_dir,
+     "Time reading DIR/info.json instead, --lookups times", "DIR"},
+    {NULL}};
+
+static void finish_lookup(DropboxFileInfoCommandResponse *dficr);
+
+static void send_lookups(void) {
+  while (sent < lookups && sent - done < window) {
+    BenchLookup *lookup = g_new0(BenchLookup, 1);
+
+    lookup->dfic.dc.request_type = GET_FILE_INFO;
+    lookup->dfic.path =
+        g_strdup_printf("%s/Dropbox/file-%d", g_get_home_dir(), sent);
+    lookup->dfic.is_dir = FALSE;
+    lookup->dfic.handler = finish_lookup;
+    lookup->start = g_get_monotonic_time();
+    sent++;
+
+    dropbox_command_client_request(&dcc, (DropboxCommand *)lookup);
+  }
+}
+
+static void finish_lookup(DropboxFileInfoCommandResponse *dficr) {
+  BenchLookup *lookup = (BenchLookup *)dficr->dfic;
+  gint64 usec = g_get_monotonic_time() - lookup->start;
+
+  g_array_append_val(times, usec);
+  done++;
+
+  if (dficr->file_status_response != NULL)
+    g_hash_table_unref(dficr->file_status_response);
+  if (dficr->folder_tag_response != NULL)
+    g_hash_table_unref(dficr->folder_tag_response);
+  if (dficr->emblems_response != NULL)
+    g_hash_table_unref(dficr->emblems_response);
+  g_free(lookup->dfic.path);
+  g_free(lookup);
+  g_free(dficr);
+
+  if (done == lookups) {
+    g_main_loop_quit(main_loop);
+  } else {
+    send_lookups();
+  }
+}
+
+static void on_connect(gpointer data) {
+  if (bench_start == 0) {
+    bench_start = g_get_monotonic_time();
+    send_lookups();
+  }
+}
+
+static gint compare_times(gconstpointer a, gconstpointer b) {
+  gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void bench_info_json(void) {
+  gint i;
+
+  bench_start = g_get_monotonic_time();
+  for (i = 0; i < lookups; i++) {
+    gint64 start = g_get_monotonic_time(), usec;
+    gchar **roots = dropbox_client_util_read_roots(info_dir);
+
+    usec = g_get_monotonic_time() - start;
+    g_array_append_val(times, usec);
+    g_strfreev(roots);
+  }
+}
+
+static void print_report(void) {
+  gint64 elapsed = g_get_monotonic_time() - bench_start, total = 0;
+  guint i;
+
+  g_array_sort(times, compare_times);
+  for (i = 0; i < times->len; i++) {
+    total += g_array_index(times, gint64, i);
+  }
+
+  if (info_dir != NULL) {
+    g_print("%u reads of %s/info.json: %.0f reads/s\n", times->len, info_dir,
+            times->len * (gdouble)G_USEC_PER_SEC / MAX(elapsed, 1));
+  } else {
+    g_print("%u lookups, window %d: %.0f lookups/s\n", times->len, window,
+            times->len * (gdouble)G_USEC_PER_SEC / MAX(elapsed, 1));
+  }
+  g_print("latency: mean %.0f us, median %" G_GINT64_FORMAT " us, p99 %"
+          G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n",
+          total / (gdouble)times->len,
+          g_array_index(times, gint64, times->len / 2),
+          g_array_index(times, gint64, times->len * 99 / 100),
+          g_array_index(times, gint64, times->len - 1));
+}
+
+int main(int argc, char **argv) {
+  GOptionContext *context;
+  GError *error = NULL;
+
+  context = g_option_context_new("COMMAND_SOCKET - time file info lookups");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error) ||
+      argc != (info_dir != NULL ? 1 : 2) || lookups <= 0 || window <= 0) {
+    g_printerr("%s\n", error != NULL ? error->message
+                                     : "Give it the command socket.");
+    return 1;
+  }
+  g_option_context_free(context);
+
+  times = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+  if (info_dir != NULL) {
+    bench_info_json();
+    print_report();
+    return 0;
+  }
+  main_loop = g_main_loop_new(NULL, FALSE);
+
+  dropbox_command_client_setup(&dcc, argv[1]);
+  /* nothing but the daemon's queue of lookups should be measured */
+  dcc.queue_limit = 0;
+  dropbox_command_client_add_on_connect_hook(
+      &dcc, (DropboxCommandClientConnectHook)on_connect, NULL);
+  dropbox_command_client_start(&dcc);
+
+  g_main_loop_run(main_loop);
+
+  print_report();
+  return 0;
+}
@@ -21,6 +21,8 @@
  *
  */
 
+#include <string.h>
+
 #include "dropbox-client-util.h"
 
 static gchar chars_not_to_escape[] = {
@@ -80,3 +82,595 @@ gboolean dropbox_client_util_command_parse_arg(const gchar *line,
   g_strfreev(argval);
   return retval;
 }
+
+void dropbox_client_util_append_command(GString *out,
+                                        const gchar *command_name,
+                                        GHashTable *args) {
+  gchar *sani;
+
+  sani = dropbox_client_util_sanitize(command_name);
+  g_string_append(out, sani);
+  g_string_append_c(out, '\n');
+  g_free(sani);
+
+  if (args != NULL) {
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, args);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      gchar **vals = value;
+      int i;
+
+      sani = dropbox_client_util_sanitize(key);
+      g_string_append(out, sani);
+      g_free(sani);
+
+      for (i = 0; vals[i] != NULL; i++) {
+        sani = dropbox_client_util_sanitize(vals[i]);
+        g_string_append_c(out, '\t');
+        g_string_append(out, sani);
+        g_free(sani);
+      }
+      g_string_append_c(out, '\n');
+    }
+  }
+
+  g_string_append(out, "done\n");
+}
+
+gchar *dropbox_client_util_next_line(GString *buf, gsize *pos) {
+  gchar *start, *newline;
+  gchar *line;
+
+  start = buf->str + *pos;
+  newline = memchr(start, '\n', buf->len - *pos);
+  if (newline == NULL) {
+    return NULL;
+  }
+
+  line = g_strndup(start, newline - start);
+  *pos += newline - start + 1;
+  return line;
+}
+
+static void append_u32(GString *out, guint32 v) {
+  v = GUINT32_TO_BE(v);
+  g_string_append_len(out, (const gchar *)&v, 4);
+}
+
+static void append_str(GString *out, const gchar *s) {
+  gsize len = strlen(s);
+
+  append_u32(out, len);
+  g_string_append_len(out, s, len);
+}
+
+/* writes the length of everything after the u32 at start */
+static void patch_length(GString *out, gsize start) {
+  guint32 len = GUINT32_TO_BE(out->len - start - 4);
+
+  memcpy(out->str + start, &len, 4);
+}
+
+void dropbox_client_util_append_frame(GString *out, guint32 request_id,
+                                      gchar kind, const gchar *command_name,
+                                      GHashTable *args) {
+  gsize start = out->len;
+
+  append_u32(out, 0);
+  append_u32(out, request_id);
+  g_string_append_c(out, kind);
+  if (command_name != NULL) {
+    append_str(out, command_name);
+  }
+  append_u32(out, args != NULL ? g_hash_table_size(args) : 0);
+
+  if (args != NULL) {
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, args);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      gchar **vals = value;
+      gsize field_start;
+      int i;
+
+      g_string_append_c(out, DROPBOX_FIELD_STRINGS);
+      field_start = out->len;
+      append_u32(out, 0);
+      append_str(out, key);
+      append_u32(out, g_strv_length(vals));
+      for (i = 0; vals[i] != NULL; i++) {
+        append_str(out, vals[i]);
+      }
+      patch_length(out, field_start);
+    }
+  }
+
+  patch_length(out, start);
+}
+
+typedef struct {
+  const gchar *p;
+  const gchar *end;
+} FrameReader;
+
+static gboolean read_u32(FrameReader *r, guint32 *v) {
+  if (r->end - r->p < 4) {
+    return FALSE;
+  }
+
+  memcpy(v, r->p, 4);
+  *v = GUINT32_FROM_BE(*v);
+  r->p += 4;
+  return TRUE;
+}
+
+static gchar *read_str(FrameReader *r) {
+  guint32 len;
+  gchar *s;
+
+  if (read_u32(r, &len) == FALSE || len > (gsize)(r->end - r->p)) {
+    return NULL;
+  }
+
+  s = g_strndup(r->p, len);
+  r->p += len;
+  return s;
+}
+
+static gboolean read_strings_field(FrameReader *f, GHashTable *args) {
+  gchar *key, **vals;
+  guint32 n, i;
+
+  key = read_str(f);
+  /* every value takes at least its length */
+  if (key == NULL || read_u32(f, &n) == FALSE ||
+      n > (gsize)(f->end - f->p) / 4) {
+    g_free(key);
+    return FALSE;
+  }
+
+  vals = g_new0(gchar *, n + 1);
+  for (i = 0; i < n; i++) {
+    if ((vals[i] = read_str(f)) == NULL) {
+      g_free(key);
+      g_strfreev(vals);
+      return FALSE;
+    }
+  }
+
+  g_hash_table_insert(args, key, vals);
+  return TRUE;
+}
+
+DropboxFrameStatus dropbox_client_util_next_frame(GString *buf, gsize *pos,
+                                                  guint32 *request_id,
+                                                  gchar *kind,
+                                                  gchar **command_name,
+                                                  GHashTable **args) {
+  FrameReader r;
+  GHashTable *table = NULL;
+  gchar *name = NULL;
+  guint32 len, nfields, i;
+
+  r.p = buf->str + *pos;
+  r.end = buf->str + buf->len;
+  if (read_u32(&r, &len) == FALSE) {
+    return DROPBOX_FRAME_INCOMPLETE;
+  }
+  if (len > DROPBOX_FRAME_MAX) {
+    return DROPBOX_FRAME_BAD;
+  }
+  if (len > (gsize)(r.end - r.p)) {
+    return DROPBOX_FRAME_INCOMPLETE;
+  }
+  r.end = r.p + len;
+
+  if (read_u32(&r, request_id) == FALSE || r.p == r.end) {
+    goto bad;
+  }
+  *kind = *r.p++;
+
+  if (*kind == DROPBOX_FRAME_COMMAND && (name = read_str(&r)) == NULL) {
+    goto bad;
+  }
+  if (read_u32(&r, &nfields) == FALSE) {
+    goto bad;
+  }
+
+  table =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+  for (i = 0; i < nfields; i++) {
+    FrameReader f;
+    guint32 flen;
+    guchar type;
+
+    if (r.p == r.end) {
+      goto bad;
+    }
+    type = *r.p++;
+    if (read_u32(&r, &flen) == FALSE || flen > (gsize)(r.end - r.p)) {
+      goto bad;
+    }
+    f.p = r.p;
+    f.end = r.p + flen;
+    r.p += flen;
+
+    /* newer field types are for newer clients */
+    if (type == DROPBOX_FIELD_STRINGS &&
+        read_strings_field(&f, table) == FALSE) {
+      goto bad;
+    }
+  }
+
+  if (r.p != r.end) {
+    goto bad;
+  }
+
+  *pos = r.end - buf->str;
+  if (command_name != NULL) {
+    *command_name = name;
+  } else {
+    g_free(name);
+  }
+  *args = table;
+  return DROPBOX_FRAME_PARSED;
+
+bad:
+  g_free(name);
+  if (table != NULL) {
+    g_hash_table_destroy(table);
+  }
+  return DROPBOX_FRAME_BAD;
+}
+
+/* info.json is small and trusted only so far, nothing nests deeper */
+#define JSON_MAX_DEPTH 32
+
+static void json_space(const gchar **p) {
+  while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r') (*p)++;
+}
+
+static gboolean json_hex4(const gchar *s, gunichar *c) {
+  int i;
+
+  *c = 0;
+  for (i = 0; i < 4; i++) {
+    if (!g_ascii_isxdigit(s[i])) {
+      return FALSE;
+    }
+    *c = (*c << 4) | g_ascii_xdigit_value(s[i]);
+  }
+  return TRUE;
+}
+
+/* decodes the JSON string starting at the opening quote at *p, leaves *p
+   after the closing quote.  returns NULL on malformed input, and for
+   strings no path can hold: NUL characters, lone surrogates or invalid
+   UTF-8. */
+static gchar *json_string(const gchar **p) {
+  GString *str = g_string_new(NULL);
+  const gchar *s = *p + 1;
+
+  while (*s != '"') {
+    gunichar c;
+
+    if ((guchar)*s < 0x20) {
+      /* the end of the input or a raw control character */
+      goto bad;
+    } else if (*s != '\\') {
+      g_string_append_c(str, *s++);
+      continue;
+    }
+
+    s++;
+    switch (*s) {
+      case '"':
+      case '\\':
+      case '/':
+        g_string_append_c(str, *s);
+        break;
+      case 'b':
+        g_string_append_c(str, '\b');
+        break;
+      case 'f':
+        g_string_append_c(str, '\f');
+        break;
+      case 'n':
+        g_string_append_c(str, '\n');
+        break;
+      case 'r':
+        g_string_append_c(str, '\r');
+        break;
+      case 't':
+        g_string_append_c(str, '\t');
+        break;
+      case 'u':
+        if (!json_hex4(s + 1, &c) || c == 0 || (c >= 0xdc00 && c < 0xe000)) {
+          goto bad;
+        }
+        s += 4;
+
+        /* a high surrogate has to be followed by a low one */
+        if (c >= 0xd800 && c < 0xdc00) {
+          gunichar lo;
+
+          if (s[1] != '\\' || s[2] != 'u' || !json_hex4(s + 3, &lo) ||
+              lo < 0xdc00 || lo >= 0xe000) {
+            goto bad;
+          }
+          c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+          s += 6;
+        }
+
+        g_string_append_unichar(str, c);
+        break;
+      default:
+        goto bad;
+    }
+    s++;
+  }
+
+  if (!g_utf8_validate(str->str, str->len, NULL)) {
+    goto bad;
+  }
+
+  *p = s + 1;
+  return g_string_free(str, FALSE);
+
+bad:
+  g_string_free(str, TRUE);
+  return NULL;
+}
+
+static gboolean json_skip_value(const gchar **p, gint depth);
+
+/* the value of member key starts at *p, the function consumes it */
+typedef gboolean (*JsonMemberFunc)(const gchar *key, const gchar **p,
+                                   gint depth, gpointer data);
+
+/* walks the object at *p, calling member for each of its members */
+static gboolean json_object(const gchar **p, gint depth, JsonMemberFunc member,
+                            gpointer data) {
+  if (**p != '{' || depth > JSON_MAX_DEPTH) {
+    return FALSE;
+  }
+  (*p)++;
+  json_space(p);
+  if (**p == '}') {
+    (*p)++;
+    return TRUE;
+  }
+
+  for (;;) {
+    gchar *key;
+    gboolean ok;
+
+    if (**p != '"' || (key = json_string(p)) == NULL) {
+      return FALSE;
+    }
+    json_space(p);
+    if (**p != ':') {
+      g_free(key);
+      return FALSE;
+    }
+    (*p)++;
+    json_space(p);
+
+    ok = member(key, p, depth, data);
+    g_free(key);
+    if (!ok) {
+      return FALSE;
+    }
+
+    json_space(p);
+    if (**p == '}') {
+      (*p)++;
+      return TRUE;
+    } else if (**p != ',') {
+      return FALSE;
+    }
+    (*p)++;
+    json_space(p);
+  }
+}
+
+static gboolean skip_member(const gchar *key, const gchar **p, gint depth,
+                            gpointer data) {
+  return json_skip_value(p, depth + 1);
+}
+
+static gboolean json_literal(const gchar **p, const gchar *word) {
+  gsize len = strlen(word);
+
+  if (strncmp(*p, word, len) != 0) {
+    return FALSE;
+  }
+  *p += len;
+  return TRUE;
+}
+
+static gboolean json_skip_value(const gchar **p, gint depth) {
+  const gchar *start = *p;
+
+  switch (**p) {
+    case '"': {
+      gchar *s = json_string(p);
+
+      g_free(s);
+      return s != NULL;
+    }
+    case '{':
+      return json_object(p, depth, skip_member, NULL);
+    case '[':
+      if (depth > JSON_MAX_DEPTH) {
+        return FALSE;
+      }
+      (*p)++;
+      json_space(p);
+      if (**p == ']') {
+        (*p)++;
+        return TRUE;
+      }
+      for (;;) {
+        if (!json_skip_value(p, depth + 1)) {
+          return FALSE;
+        }
+        json_space(p);
+        if (**p == ']') {
+          (*p)++;
+          return TRUE;
+        } else if (**p != ',') {
+          return FALSE;
+        }
+        (*p)++;
+        json_space(p);
+      }
+    case 't':
+      return json_literal(p, "true");
+    case 'f':
+      return json_literal(p, "false");
+    case 'n':
+      return json_literal(p, "null");
+    default:
+      /* a number, nothing looks at them */
+      while (**p != '\0' &&
+             (g_ascii_isdigit(**p) || strchr("+-.eE", **p) != NULL)) {
+        (*p)++;
+      }
+      return *p != start;
+  }
+}
+
+static gboolean account_member(const gchar *key, const gchar **p, gint depth,
+                               GPtrArray *roots) {
+  gchar *path;
+  gsize len;
+
+  if (strcmp(key, "path") != 0 || **p != '"') {
+    return json_skip_value(p, depth + 1);
+  }
+
+  if ((path = json_string(p)) == NULL) {
+    return FALSE;
+  }
+
+  if (!g_path_is_absolute(path)) {
+    g_free(path);
+    return TRUE;
+  }
+
+  /* match children with a simple "root/" prefix check later */
+  len = strlen(path);
+  while (len > 1 && path[len - 1] == '/') path[--len] = '\0';
+  g_ptr_array_add(roots, path);
+  return TRUE;
+}
+
+static gboolean info_member(const gchar *key, const gchar **p, gint depth,
+                            GPtrArray *roots) {
+  if ((strcmp(key, "personal") == 0 || strcmp(key, "business") == 0) &&
+      **p == '{') {
+    return json_object(p, depth + 1, (JsonMemberFunc)account_member, roots);
+  }
+  return json_skip_value(p, depth + 1);
+}
+
+/*
+  Simplifies a path by removing navigation elements such as '.' and '..'
+  and duplicate slashes, in a single pass over the path.
+
+  Arguments:
+    - path: input path to be canonicalized
+    - out: receives the canonicalized path, needs room for strlen(path) + 1
+      bytes, can be path itself
+
+  Returns:
+    TRUE if input path is valid.
+    FALSE otherwise, out is left in an unspecified state.
+*/
+gboolean dropbox_client_util_canonicalize_path_into(const gchar *path,
+                                                   gchar *out) {
+  /* out always holds "/" followed by the components kept so far, joined by
+     slashes, or just the components once a ".." went above the root */
+  gboolean rooted = TRUE;
+  gsize o = 1;
+
+  g_assert(path != NULL);
+  g_assert(path[0] == '/');
+
+  out[0] = '/';
+
+  while (*path != '\0') {
+    const gchar *elt;
+    gsize len;
+
+    while (*path == '/') path++;
+    if (*path == '\0') break;
+
+    elt = path;
+    while (*path != '\0' && *path != '/') path++;
+    len = path - elt;
+
+    if (len == 2 && elt[0] == '.' && elt[1] == '.') {
+      if (o > (rooted ? 1 : 0)) {
+        /* drop the last component */
+        while (o > 0 && out[o - 1] != '/') o--;
+        if (o > (rooted ? 1 : 0)) o--;
+      } else if (rooted) {
+        rooted = FALSE;
+        o = 0;
+      } else {
+        // Input path has too many parent directory references and is invalid
+        return FALSE;
+      }
+    } else if (len != 1 || elt[0] != '.') {
+      if (o > (rooted ? 1 : 0)) {
+        out[o++] = '/';
+      }
+      /* never ahead of what we've read, so this is safe in place */
+      memmove(out + o, elt, len);
+      o += len;
+    }
+  }
+
+  out[o] = '\0';
+  return TRUE;
+}
+
+gchar **dropbox_client_util_parse_roots(const gchar *contents) {
+  GPtrArray *roots = g_ptr_array_new_with_free_func(g_free);
+  const gchar *p = contents;
+
+  /* info.json has an object per account ("personal", "business"), each
+     with a "path" member naming the Dropbox folder.  anything else in it
+     is skipped, a malformed file counts as empty. */
+  json_space(&p);
+  if (!json_object(&p, 0, (JsonMemberFunc)info_member, roots) ||
+      (json_space(&p), *p != '\0')) {
+    g_ptr_array_set_size(roots, 0);
+  }
+
+  g_ptr_array_set_free_func(roots, NULL);
+  g_ptr_array_add(roots, NULL);
+  return (gchar **)g_ptr_array_free(roots, FALSE);
+}
+
+gchar **dropbox_client_util_read_roots(const gchar *dropbox_dir) {
+  gchar *filename, *contents;
+  gchar **roots;
+
+  filename = g_build_filename(dropbox_dir, "info.json", NULL);
+  if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+    roots = dropbox_client_util_parse_roots(contents);
+    g_free(contents);
+  } else {
+    roots = g_new0(gchar *, 1);
+  }
+  g_free(filename);
+
+  return roots;
+}
@@ -34,6 +34,73 @@ gchar *dropbox_client_util_desanitize(const gchar *a);
 gboolean dropbox_client_util_command_parse_arg(const gchar *line,
                                                GHashTable *return_table);
 
+/* appends a whole command, "done" included, in the socket line format */
+void dropbox_client_util_append_command(GString *out,
+                                        const gchar *command_name,
+                                        GHashTable *args);
+
+/* returns the next complete line of buf at or after *pos without its
+   newline, and moves *pos past it.  NULL if there is no newline yet, the
+   caller erases the consumed part of buf when it's done. */
+gchar *dropbox_client_util_next_line(GString *buf, gsize *pos);
+
+/* binary framing, used on the command socket once both sides agree on it.
+   a client offers it by sending DROPBOX_FRAMING_COMMAND with a "framings"
+   arg, a daemon that answers "ok" with "framing\tbinary1" switches right
+   after its "done" line.  every message is then one frame:
+
+     u32 length of the rest of the frame
+     u32 request id, a reply carries the id of its command
+     u8  kind, DROPBOX_FRAME_COMMAND, _OK or _ERROR
+     str command name, commands only
+     u32 number of fields
+         u8 type, u32 length of the field, then the field itself
+
+   numbers are big endian and a str is a u32 length and that many bytes,
+   nothing is escaped.  a DROPBOX_FIELD_STRINGS field is a str key, a u32
+   count and that many str values, i.e. one argument line of the text
+   protocol.  fields of other types are skipped. */
+#define DROPBOX_FRAMING_COMMAND "negotiate_framing"
+#define DROPBOX_FRAMING_BINARY "binary1"
+#define DROPBOX_FRAME_COMMAND 'C'
+#define DROPBOX_FRAME_OK 'K'
+#define DROPBOX_FRAME_ERROR 'E'
+#define DROPBOX_FIELD_STRINGS 1
+/* bigger frames are garbage */
+#define DROPBOX_FRAME_MAX (16 * 1024 * 1024)
+
+typedef enum {
+  DROPBOX_FRAME_INCOMPLETE,
+  DROPBOX_FRAME_PARSED,
+  DROPBOX_FRAME_BAD
+} DropboxFrameStatus;
+
+/* appends one frame, command_name is NULL for replies */
+void dropbox_client_util_append_frame(GString *out, guint32 request_id,
+                                      gchar kind, const gchar *command_name,
+                                      GHashTable *args);
+
+/* parses the frame at *pos in buf and moves *pos past it.  args gets a new
+   table like the text replies, command_name (if not NULL) the command's
+   name or NULL. */
+DropboxFrameStatus dropbox_client_util_next_frame(GString *buf, gsize *pos,
+                                                  guint32 *request_id,
+                                                  gchar *kind,
+                                                  gchar **command_name,
+                                                  GHashTable **args);
+
+/* resolves '.', '..' and duplicate slashes of the absolute path into out,
+   which has room for strlen(path) + 1 bytes and may be path itself.  FALSE
+   if the path has too many '..'. */
+gboolean dropbox_client_util_canonicalize_path_into(const gchar *path,
+                                                   gchar *out);
+
+/* the absolute "path" members of the "personal" and "business" accounts
+   in the contents of an info.json, empty if it is malformed */
+gchar **dropbox_client_util_parse_roots(const gchar *contents);
+/* the same for dropbox_dir/info.json, read synchronously */
+gchar **dropbox_client_util_read_roots(const gchar *dropbox_dir);
+
 G_END_DECLS
 
 #endif
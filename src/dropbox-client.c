@@ -34,6 +34,7 @@ static void hook_on_connect(DropboxClient *dc) {
 
   if (dc->command_connect_called) {
     g_debug("client connection");
+    dc->generation++;
     g_hook_list_invoke(&(dc->onconnect_hooklist), FALSE);
     /* reset flags */
     dc->hook_connect_called = dc->command_connect_called = FALSE;
@@ -45,6 +46,7 @@ static void command_on_connect(DropboxClient *dc) {
 
   if (dc->hook_connect_called) {
     g_debug("client connection");
+    dc->generation++;
     g_hook_list_invoke(&(dc->onconnect_hooklist), FALSE);
     /* reset flags */
     dc->hook_connect_called = dc->command_connect_called = FALSE;
@@ -91,15 +93,25 @@ void dropbox_client_force_reconnect(DropboxClient *dc) {
 }
 
 /* should only be called once on initialization */
-void dropbox_client_setup(DropboxClient *dc) {
-  caja_dropbox_hooks_setup(&(dc->hookserv));
-  dropbox_command_client_setup(&(dc->dcc));
+void dropbox_client_setup(DropboxClient *dc, const gchar *socket_dir) {
+  gchar *socket_path;
+
+  dc->socket_dir = g_strdup(socket_dir);
+
+  socket_path = g_build_filename(socket_dir, "iface_socket", NULL);
+  caja_dropbox_hooks_setup(&(dc->hookserv), socket_path);
+  g_free(socket_path);
+
+  socket_path = g_build_filename(socket_dir, "command_socket", NULL);
+  dropbox_command_client_setup(&(dc->dcc), socket_path);
+  g_free(socket_path);
 
   g_hook_list_init(&(dc->ondisconnect_hooklist), sizeof(GHook));
   g_hook_list_init(&(dc->onconnect_hooklist), sizeof(GHook));
 
   dc->hook_disconnect_called = dc->command_disconnect_called = FALSE;
   dc->hook_connect_called = dc->command_connect_called = FALSE;
+  dc->generation = 0;
 
   caja_dropbox_hooks_add_on_connect_hook(
       &(dc->hookserv), (DropboxHookClientConnectHook)hook_on_connect, dc);
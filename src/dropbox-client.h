@@ -32,6 +32,8 @@
 G_BEGIN_DECLS
 
 typedef struct {
+  /* the daemon's directory, usually ~/.dropbox */
+  gchar *socket_dir;
   DropboxCommandClient dcc;
   CajaDropboxHookserv hookserv;
   GHookList onconnect_hooklist;
@@ -40,12 +42,15 @@ typedef struct {
   gboolean command_connect_called;
   gboolean hook_disconnect_called;
   gboolean command_disconnect_called;
+  /* bumped every time both sockets are up again, lets callers tell
+     state learned on an older connection apart from fresh state */
+  guint generation;
 } DropboxClient;
 
 typedef void (*DropboxClientConnectionAttemptHook)(guint, gpointer);
 typedef GHookFunc DropboxClientConnectHook;
 
-void dropbox_client_setup(DropboxClient *dc);
+void dropbox_client_setup(DropboxClient *dc, const gchar *socket_dir);
 
 void dropbox_client_start(DropboxClient *dc);
 
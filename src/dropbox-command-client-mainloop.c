@@ -0,0 +1,983 @@
+/*
+ * dropbox-command-client-mainloop.c
+ * Implements the Dropbox command socket client on the glib main loop,
+ * without a thread.  Built instead of dropbox-command-client.c with
+ * --enable-mainloop-command-client.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dropbox-command-client.h"
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "async-io-coroutine.h"
+#include "dropbox-client-util.h"
+#include "dropbox-command-queue.h"
+#include "dropbox-probes.h"
+#include "dropbox-recorder.h"
+#include "dropbox-stats.h"
+#include "dropbox-watchdog.h"
+
+/* how long a connect and a reply may take, and how long to wait before
+   trying again when the daemon isn't there (in milliseconds) */
+#define CONNECT_TIMEOUT 1000
+#define REPLY_TIMEOUT 3000
+#define RECONNECT_INTERVAL 1000
+
+typedef struct {
+  DropboxCommandClientConnectionAttemptHook h;
+  gpointer ud;
+} DropboxCommandClientConnectionAttempt;
+
+typedef enum {
+  /* nothing asked, anything the daemon sends is garbage */
+  REPLY_NONE,
+  REPLY_STATUS,
+  REPLY_ARGS,
+  /* not "ok", skip to "done" */
+  REPLY_FAILED,
+  REPLY_DONE,
+  /* the connection went away before the reply was done */
+  REPLY_BROKEN
+} ReplyState;
+
+struct _DropboxCommandLoop {
+  GSocket *socket;
+  GSource *connect_source;
+  guint connect_timeout;
+  guint reconnect_source;
+  guint connection_attempts;
+  GSource *read_source;
+  GSource *write_source;
+  GString *inbuf;
+  GString *outbuf;
+
+  /* offer binary frames before the first request */
+  gboolean negotiate;
+
+  /* the reply to the one command on the wire */
+  ReplyState reply_state;
+  GHashTable *reply;
+  guint reply_numargs;
+  guint reply_timeout;
+  /* for the socket time of the command on the wire */
+  const gchar *sent_name;
+  gint64 sent_time;
+  /* for dropbox-recorder.h */
+  guint32 sent_sequence;
+
+  /* requests are picked up by one idle per burst */
+  gint run_idle;
+  /* lookups dropped from a full queue, answered from that idle */
+  GAsyncQueue *shed;
+  gboolean running;
+  gboolean rerun;
+
+  /* command coroutine, see run_commands() */
+  gint line;
+  DropboxCommand *dc;
+  GHashTable *emblems_response;
+  GHashTable *file_status_response;
+  GHashTable *folder_tag_response;
+  GHashTable *response;
+};
+
+typedef struct _DropboxCommandLoop DropboxCommandLoop;
+
+static gboolean try_to_connect(DropboxCommandClient *dcc);
+static void run_commands(DropboxCommandClient *dcc);
+
+static void set_connected(DropboxCommandClient *dcc, gboolean connected) {
+  g_mutex_lock(&(dcc->command_connected_mutex));
+  dcc->command_connected = connected;
+  g_mutex_unlock(&(dcc->command_connected_mutex));
+}
+
+static void finish_general_command(DropboxGeneralCommand *dgc,
+                                   GHashTable *response) {
+  dropbox_command_finished(&(dgc->dc));
+
+  if (dgc->handler != NULL) {
+    dgc->handler(response, dgc->handler_ud);
+  }
+
+  if (response != NULL) {
+    g_hash_table_unref(response);
+  }
+
+  g_free(dgc->command_name);
+  if (dgc->command_args != NULL) {
+    g_hash_table_unref(dgc->command_args);
+  }
+  g_free(dgc);
+}
+
+static void finish_file_info_command(DropboxFileInfoCommand *dfic,
+                                     GHashTable *emblems_response,
+                                     GHashTable *file_status_response,
+                                     GHashTable *folder_tag_response) {
+  DropboxFileInfoCommandResponse *dficr;
+
+  dropbox_command_finished(&(dfic->dc));
+
+  /* we are on the main loop already, no need to queue it */
+  dficr = g_new0(DropboxFileInfoCommandResponse, 1);
+  dficr->dfic = dfic;
+  dficr->emblems_response = emblems_response;
+  dficr->file_status_response = file_status_response;
+  dficr->folder_tag_response = folder_tag_response;
+  dfic->handler(dficr);
+}
+
+/* marks the request as never to be completed */
+static void end_request(DropboxCommand *dc) {
+  dropbox_stats_add("commands.unanswered", 1);
+  switch (dc->request_type) {
+    case GET_FILE_INFO:
+      finish_file_info_command((DropboxFileInfoCommand *)dc, NULL, NULL,
+                               NULL);
+      break;
+    case GENERAL_COMMAND:
+      finish_general_command((DropboxGeneralCommand *)dc, NULL);
+      break;
+    default:
+      g_assert_not_reached();
+      break;
+  }
+}
+
+static void close_socket(DropboxCommandLoop *loop) {
+  if (loop->connect_source != NULL) {
+    g_source_destroy(loop->connect_source);
+    g_source_unref(loop->connect_source);
+    loop->connect_source = NULL;
+  }
+  if (loop->connect_timeout != 0) {
+    g_source_remove(loop->connect_timeout);
+    loop->connect_timeout = 0;
+  }
+  if (loop->read_source != NULL) {
+    g_source_destroy(loop->read_source);
+    g_source_unref(loop->read_source);
+    loop->read_source = NULL;
+  }
+  if (loop->write_source != NULL) {
+    g_source_destroy(loop->write_source);
+    g_source_unref(loop->write_source);
+    loop->write_source = NULL;
+  }
+  if (loop->reply_timeout != 0) {
+    g_source_remove(loop->reply_timeout);
+    loop->reply_timeout = 0;
+  }
+  if (loop->socket != NULL) {
+    g_socket_close(loop->socket, NULL);
+    g_object_unref(loop->socket);
+    loop->socket = NULL;
+  }
+
+  g_string_truncate(loop->inbuf, 0);
+  g_string_truncate(loop->outbuf, 0);
+}
+
+static void lose_connection(DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+  DropboxCommand *dc;
+
+  g_debug("command client disconnected");
+  dropbox_stats_add("command.disconnects", 1);
+  DROPBOX_PROBE(disconnect, "command", dcc->socket_path, 0);
+
+  close_socket(loop);
+
+  if (loop->reply != NULL) {
+    g_hash_table_unref(loop->reply);
+    loop->reply = NULL;
+  }
+  if (loop->reply_state != REPLY_NONE && loop->reply_state != REPLY_DONE) {
+    loop->reply_state = REPLY_BROKEN;
+  }
+
+  set_connected(dcc, FALSE);
+
+  /* let the command that was on the wire finish with nothing */
+  run_commands(dcc);
+
+  /* fail everything that is waiting, who knows how long we'll be
+     disconnected */
+  while ((dc = dropbox_command_queue_pop(dcc, 0)) != NULL) {
+    end_request(dc);
+  }
+
+  g_hook_list_invoke(&(dcc->ondisconnect_hooklist), FALSE);
+
+  if (loop->reconnect_source == 0) {
+    loop->reconnect_source = g_idle_add((GSourceFunc)try_to_connect, dcc);
+  }
+}
+
+static gboolean reply_timed_out(DropboxCommandClient *dcc) {
+  g_debug("dropbox command connection timed out");
+
+  dropbox_watchdog_enter("command.reply_timeout");
+  dcc->loop->reply_timeout = 0;
+  lose_connection(dcc);
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+static gboolean handle_output(GSocket *socket, GIOCondition cond,
+                              DropboxCommandClient *dcc);
+
+/* writes as much of the output buffer as the socket takes, the rest goes
+   out when it becomes writable */
+static gboolean flush_output(DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+
+  while (loop->outbuf->len > 0) {
+    GError *gerr = NULL;
+    gssize n;
+
+    n = g_socket_send(loop->socket, loop->outbuf->str, loop->outbuf->len, NULL,
+                      &gerr);
+    if (n < 0) {
+      if (g_error_matches(gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_error_free(gerr);
+        if (loop->write_source == NULL) {
+          loop->write_source =
+              g_socket_create_source(loop->socket, G_IO_OUT, NULL);
+          g_source_set_callback(loop->write_source, (GSourceFunc)handle_output,
+                                dcc, NULL);
+          g_source_attach(loop->write_source, NULL);
+        }
+        return TRUE;
+      }
+
+      g_debug("command error: %s", gerr->message);
+      g_error_free(gerr);
+      return FALSE;
+    }
+
+    g_string_erase(loop->outbuf, 0, n);
+  }
+
+  dropbox_command_mark(loop->dc, DROPBOX_MARK_WRITTEN);
+  return TRUE;
+}
+
+static gboolean handle_output(GSocket *socket, GIOCondition cond,
+                              DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+
+  dropbox_watchdog_enter("command.output");
+  g_source_unref(loop->write_source);
+  loop->write_source = NULL;
+
+  if (flush_output(dcc) == FALSE) {
+    lose_connection(dcc);
+  }
+  dropbox_watchdog_leave();
+
+  /* flush_output made a new source if it still couldn't write it all */
+  return FALSE;
+}
+
+/* puts a command on the wire, run_commands() waits for the reply */
+static void send_command(DropboxCommandClient *dcc, const gchar *command_name,
+                         GHashTable *args) {
+  DropboxCommandLoop *loop = dcc->loop;
+
+  if (loop->socket == NULL) {
+    loop->reply_state = REPLY_BROKEN;
+    return;
+  }
+
+  DROPBOX_PROBE(command__send, command_name,
+                loop->dc != NULL ? dropbox_command_path(loop->dc) : NULL,
+                loop->dc != NULL ? loop->dc->id : 0);
+  dropbox_command_mark(loop->dc, DROPBOX_MARK_SEND);
+  if (dcc->binary_framing) {
+    dropbox_client_util_append_frame(loop->outbuf, ++dcc->request_id,
+                                     DROPBOX_FRAME_COMMAND, command_name, args);
+  } else {
+    dropbox_client_util_append_command(loop->outbuf, command_name, args);
+  }
+  loop->reply_state = REPLY_STATUS;
+  loop->sent_name = command_name;
+  loop->sent_time = g_get_monotonic_time();
+  loop->sent_sequence =
+      dropbox_recorder_command(dcc->socket_path, command_name, args);
+  loop->reply_timeout =
+      g_timeout_add(REPLY_TIMEOUT, (GSourceFunc)reply_timed_out, dcc);
+
+  if (flush_output(dcc) == FALSE) {
+    lose_connection(dcc);
+  }
+}
+
+static void send_path_command(DropboxCommandClient *dcc,
+                              const gchar *command_name, const gchar *path) {
+  GHashTable *args;
+  gchar **path_arg;
+
+  args =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+  path_arg = g_new(gchar *, 2);
+  path_arg[0] = g_strdup(path);
+  path_arg[1] = NULL;
+  g_hash_table_insert(args, g_strdup("path"), path_arg);
+
+  send_command(dcc, command_name, args);
+  g_hash_table_unref(args);
+}
+
+static void send_framing_command(DropboxCommandClient *dcc) {
+  GHashTable *args;
+  gchar **framings;
+
+  args =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+  framings = g_new(gchar *, 2);
+  framings[0] = g_strdup(DROPBOX_FRAMING_BINARY);
+  framings[1] = NULL;
+  g_hash_table_insert(args, g_strdup("framings"), framings);
+
+  send_command(dcc, DROPBOX_FRAMING_COMMAND, args);
+  g_hash_table_unref(args);
+}
+
+static void use_framing(DropboxCommandClient *dcc, GHashTable *response) {
+  gchar **framing;
+
+  if (response != NULL &&
+      (framing = g_hash_table_lookup(response, "framing")) != NULL &&
+      strcmp(framing[0], DROPBOX_FRAMING_BINARY) == 0) {
+    g_debug("using binary frames");
+    dcc->binary_framing = TRUE;
+  } else {
+    dcc->framing_refused = TRUE;
+  }
+
+  if (response != NULL) {
+    g_hash_table_unref(response);
+  }
+}
+
+static GHashTable *take_reply(DropboxCommandLoop *loop) {
+  GHashTable *reply = loop->reply;
+
+  dropbox_command_mark(loop->dc, DROPBOX_MARK_DONE);
+  DROPBOX_PROBE(command__reply, loop->sent_name,
+                loop->dc != NULL ? dropbox_command_path(loop->dc) : NULL,
+                loop->dc != NULL ? loop->dc->id : 0);
+  dropbox_stats_record_since(loop->sent_name, DROPBOX_STATS_SOCKET,
+                             loop->sent_time);
+  loop->reply = NULL;
+  loop->reply_state = REPLY_NONE;
+  return reply;
+}
+
+static void clear_command(DropboxCommandLoop *loop) {
+  if (loop->emblems_response != NULL) {
+    g_hash_table_unref(loop->emblems_response);
+  }
+  if (loop->file_status_response != NULL) {
+    g_hash_table_unref(loop->file_status_response);
+  }
+  if (loop->folder_tag_response != NULL) {
+    g_hash_table_unref(loop->folder_tag_response);
+  }
+  if (loop->response != NULL) {
+    g_hash_table_unref(loop->response);
+  }
+
+  loop->dc = NULL;
+  loop->emblems_response = NULL;
+  loop->file_status_response = NULL;
+  loop->folder_tag_response = NULL;
+  loop->response = NULL;
+}
+
+/* waits for the reply to the command just sent, and leaves the current
+   request if the connection broke meanwhile */
+#define CRWAITREPLY(pos, loop)                 \
+  while ((loop)->reply_state != REPLY_DONE) {  \
+    if ((loop)->reply_state == REPLY_BROKEN) { \
+      goto BADCONNECTION;                      \
+    }                                          \
+    CRYIELD(pos);                              \
+  }
+
+/* the requests, one at a time, as a microthread.  it runs whenever a
+   request comes in or a reply is done, it only ever waits in CRYIELD */
+static gboolean command_coroutine(DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+
+  CRBEGIN(loop->line);
+  while (1) {
+    /* get a request from caja */
+    while (loop->socket == NULL || loop->read_source == NULL ||
+           (loop->negotiate == FALSE &&
+            (loop->dc = dropbox_command_queue_pop(dcc, 0)) == NULL)) {
+      CRYIELD(loop->line);
+    }
+
+    if (loop->dc == NULL) {
+      /* new connection, see if the daemon does binary frames */
+      loop->negotiate = FALSE;
+      send_framing_command(dcc);
+      CRWAITREPLY(loop->line, loop);
+      use_framing(dcc, take_reply(loop));
+      continue;
+    }
+
+    dropbox_command_started(loop->dc);
+
+    if (loop->dc->request_type == GET_FILE_INFO) {
+      g_debug("doing file info command");
+
+      /* we couldn't get the filename, just return empty */
+      if (((DropboxFileInfoCommand *)loop->dc)->path != NULL) {
+        send_path_command(dcc, "get_emblems",
+                          ((DropboxFileInfoCommand *)loop->dc)->path);
+        CRWAITREPLY(loop->line, loop);
+        loop->emblems_response = take_reply(loop);
+      }
+
+      /* no emblems, fall back to the file status and folder tag */
+      if (loop->emblems_response == NULL &&
+          ((DropboxFileInfoCommand *)loop->dc)->path != NULL) {
+        dropbox_stats_add("file_info.fallbacks", 1);
+        send_path_command(dcc, "icon_overlay_file_status",
+                          ((DropboxFileInfoCommand *)loop->dc)->path);
+        CRWAITREPLY(loop->line, loop);
+        loop->file_status_response = take_reply(loop);
+
+        if (((DropboxFileInfoCommand *)loop->dc)->is_dir) {
+          send_path_command(dcc, "get_folder_tag",
+                            ((DropboxFileInfoCommand *)loop->dc)->path);
+          CRWAITREPLY(loop->line, loop);
+          loop->folder_tag_response = take_reply(loop);
+        }
+      }
+
+      dropbox_command_replied(loop->dc);
+      finish_file_info_command((DropboxFileInfoCommand *)loop->dc,
+                               loop->emblems_response,
+                               loop->file_status_response,
+                               loop->folder_tag_response);
+      loop->emblems_response = NULL;
+      loop->file_status_response = NULL;
+      loop->folder_tag_response = NULL;
+    } else {
+      g_debug("doing general command");
+
+      send_command(dcc, ((DropboxGeneralCommand *)loop->dc)->command_name,
+                   ((DropboxGeneralCommand *)loop->dc)->command_args);
+      CRWAITREPLY(loop->line, loop);
+      loop->response = take_reply(loop);
+
+      dropbox_command_replied(loop->dc);
+      finish_general_command((DropboxGeneralCommand *)loop->dc,
+                             loop->response);
+      loop->response = NULL;
+    }
+
+    g_debug("done.");
+    clear_command(loop);
+    continue;
+
+  BADCONNECTION:
+    g_debug("command error");
+    loop->reply_state = REPLY_NONE;
+    if (loop->dc != NULL) {
+      /* mark this request as never to be completed */
+      dropbox_command_replied(loop->dc);
+      end_request(loop->dc);
+    } else {
+      /* maybe it hung up on a command it didn't know, stick to text */
+      dcc->framing_refused = TRUE;
+    }
+    clear_command(loop);
+  }
+  CREND;
+}
+
+#undef CRWAITREPLY
+
+static void run_commands(DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+
+  /* handlers and hooks may get here again from inside the coroutine */
+  if (loop->running) {
+    loop->rerun = TRUE;
+    return;
+  }
+
+  loop->running = TRUE;
+  do {
+    loop->rerun = FALSE;
+    command_coroutine(dcc);
+  } while (loop->rerun);
+  loop->running = FALSE;
+}
+
+static gboolean run_requests(DropboxCommandClient *dcc) {
+  DropboxCommand *dc;
+
+  dropbox_watchdog_enter("command.requests");
+
+  /* clear this first, anything requested from now on gets another idle */
+  g_atomic_int_set(&(dcc->loop->run_idle), FALSE);
+
+  while ((dc = g_async_queue_try_pop(dcc->loop->shed)) != NULL) {
+    end_request(dc);
+  }
+
+  run_commands(dcc);
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+static gboolean handle_reply_line(DropboxCommandLoop *loop, const gchar *line) {
+  switch (loop->reply_state) {
+    case REPLY_STATUS:
+      if (strcmp("ok", line) == 0) {
+        loop->reply = g_hash_table_new_full(
+            (GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+        loop->reply_numargs = 0;
+        loop->reply_state = REPLY_ARGS;
+      } else {
+        /* read errors off until we get done */
+        loop->reply_state = REPLY_FAILED;
+      }
+      return TRUE;
+    case REPLY_ARGS:
+      if (strcmp("done", line) == 0) {
+        loop->reply_state = REPLY_DONE;
+        return TRUE;
+      }
+
+      /* if we are getting too many args, connection could be malicious */
+      if (loop->reply_numargs >= 20) {
+        g_debug("malicious connection");
+        return FALSE;
+      }
+      if (dropbox_client_util_command_parse_arg(line, loop->reply) == FALSE) {
+        g_debug("parse error");
+        return FALSE;
+      }
+      loop->reply_numargs += 1;
+      return TRUE;
+    case REPLY_FAILED:
+      if (strcmp("done", line) == 0) {
+        loop->reply_state = REPLY_DONE;
+      }
+      return TRUE;
+    default:
+      /* this makes us disconnect from bad servers
+         (those that send us information without us asking for it) */
+      return FALSE;
+  }
+}
+
+static gboolean handle_reply_frames(DropboxCommandClient *dcc, gsize *pos) {
+  DropboxCommandLoop *loop = dcc->loop;
+  DropboxFrameStatus status;
+  GHashTable *args;
+  guint32 request_id;
+  gchar kind;
+
+  while ((status = dropbox_client_util_next_frame(
+              loop->inbuf, pos, &request_id, &kind, NULL, &args)) ==
+         DROPBOX_FRAME_PARSED) {
+    /* nothing asked, or not what we asked */
+    if (loop->reply_state != REPLY_STATUS || request_id != dcc->request_id) {
+      g_hash_table_destroy(args);
+      return FALSE;
+    }
+
+    if (kind == DROPBOX_FRAME_OK) {
+      loop->reply = args;
+    } else {
+      g_hash_table_destroy(args);
+    }
+    loop->reply_state = REPLY_DONE;
+  }
+
+  if (status == DROPBOX_FRAME_BAD) {
+    g_debug("parse error");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static gboolean handle_input(GSocket *socket, GIOCondition cond,
+                             DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+  GError *gerr = NULL;
+  gchar buf[4096], *line;
+  gssize n;
+  gsize pos = 0;
+  gboolean ok = TRUE;
+
+  dropbox_watchdog_enter("command.input");
+
+  /* take everything there is, then parse it */
+  while ((n = g_socket_receive(socket, buf, sizeof(buf), NULL, &gerr)) > 0) {
+    if (loop->inbuf->len == 0 && loop->reply_state == REPLY_STATUS) {
+      dropbox_command_mark(loop->dc, DROPBOX_MARK_REPLY);
+    }
+    g_string_append_len(loop->inbuf, buf, n);
+  }
+
+  if (dcc->binary_framing) {
+    ok = handle_reply_frames(dcc, &pos);
+  } else {
+    while ((line = dropbox_client_util_next_line(loop->inbuf, &pos)) != NULL) {
+      ok = handle_reply_line(loop, line);
+      g_free(line);
+      if (ok == FALSE) {
+        break;
+      }
+    }
+  }
+  g_string_erase(loop->inbuf, 0, pos);
+
+  if (ok && loop->reply_state == REPLY_DONE) {
+    if (loop->sent_sequence != 0) {
+      dropbox_recorder_reply(dcc->socket_path, loop->sent_sequence,
+                             loop->reply);
+    }
+    g_source_remove(loop->reply_timeout);
+    loop->reply_timeout = 0;
+    run_commands(dcc);
+  }
+
+  if (n == 0) {
+    g_debug("dropbox command connection closed");
+    ok = FALSE;
+  } else if (!g_error_matches(gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+    g_debug("command error: %s", gerr->message);
+    ok = FALSE;
+  }
+  if (gerr != NULL) {
+    g_error_free(gerr);
+  }
+
+  /* the coroutine may have lost the connection itself */
+  if (ok == FALSE && loop->read_source != NULL) {
+    lose_connection(dcc);
+  }
+
+  dropbox_watchdog_leave();
+
+  /* lose_connection() destroyed this source if it's gone */
+  return TRUE;
+}
+
+static void connect_failed(DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+  GList *ll;
+
+  close_socket(loop);
+
+  for (ll = dcc->ca_hooklist; ll != NULL; ll = g_list_next(ll)) {
+    DropboxCommandClientConnectionAttempt *dccca =
+        (DropboxCommandClientConnectionAttempt *)(ll->data);
+    dccca->h(loop->connection_attempts, dccca->ud);
+  }
+  loop->connection_attempts++;
+
+  loop->reconnect_source =
+      g_timeout_add(RECONNECT_INTERVAL, (GSourceFunc)try_to_connect, dcc);
+}
+
+static void finish_connect(DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+
+  g_debug("command client connected");
+  dropbox_stats_add("command.connects", 1);
+  DROPBOX_PROBE(connect, "command", dcc->socket_path, 0);
+  loop->connection_attempts = 1;
+  dcc->binary_framing = FALSE;
+  loop->negotiate = !dcc->framing_refused;
+
+  loop->read_source =
+      g_socket_create_source(loop->socket, G_IO_IN | G_IO_HUP | G_IO_ERR, NULL);
+  g_source_set_callback(loop->read_source, (GSourceFunc)handle_input, dcc,
+                        NULL);
+  g_source_attach(loop->read_source, NULL);
+
+  set_connected(dcc, TRUE);
+  g_hook_list_invoke(&(dcc->onconnect_hooklist), FALSE);
+
+  /* requests that came in while we were away */
+  run_commands(dcc);
+}
+
+static gboolean connect_timed_out(DropboxCommandClient *dcc) {
+  g_debug("couldn't connect to command server after %d ms", CONNECT_TIMEOUT);
+
+  dropbox_watchdog_enter("command.connect");
+  dcc->loop->connect_timeout = 0;
+  connect_failed(dcc);
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+/* the socket became writable, the connect is done one way or another */
+static gboolean connect_ready(GSocket *socket, GIOCondition cond,
+                              DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+  GError *gerr = NULL;
+
+  dropbox_watchdog_enter("command.connect");
+  g_source_unref(loop->connect_source);
+  loop->connect_source = NULL;
+  g_source_remove(loop->connect_timeout);
+  loop->connect_timeout = 0;
+
+  if (g_socket_check_connect_result(socket, &gerr)) {
+    finish_connect(dcc);
+  } else {
+    g_debug("bad connection: %s", gerr->message);
+    g_error_free(gerr);
+    connect_failed(dcc);
+  }
+
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+static gboolean try_to_connect(DropboxCommandClient *dcc) {
+  DropboxCommandLoop *loop = dcc->loop;
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  int sock;
+
+  dropbox_watchdog_enter("command.connect");
+  loop->reconnect_source = 0;
+
+  if (0 > (sock = socket(PF_UNIX, SOCK_STREAM, 0))) {
+    connect_failed(dcc);
+    dropbox_watchdog_leave();
+    return FALSE;
+  }
+
+  /* GSocket puts the fd in non-blocking mode, this runs on caja's main
+     thread so nothing in here may ever wait for the daemon */
+  loop->socket = g_socket_new_from_fd(sock, NULL);
+  if (loop->socket == NULL) {
+    close(sock);
+    connect_failed(dcc);
+    dropbox_watchdog_leave();
+    return FALSE;
+  }
+  g_socket_set_blocking(loop->socket, FALSE);
+
+  /* intialize address structure */
+  addr.sun_family = AF_UNIX;
+  g_strlcpy(addr.sun_path, dcc->socket_path, sizeof(addr.sun_path));
+  addr_len = sizeof(addr) - sizeof(addr.sun_path) + strlen(addr.sun_path);
+
+  if (connect(sock, (struct sockaddr *)&addr, addr_len) == 0) {
+    finish_connect(dcc);
+  } else if (errno == EINPROGRESS) {
+    loop->connect_source = g_socket_create_source(
+        loop->socket, G_IO_OUT | G_IO_ERR | G_IO_HUP, NULL);
+    g_source_set_callback(loop->connect_source, (GSourceFunc)connect_ready,
+                          dcc, NULL);
+    g_source_attach(loop->connect_source, NULL);
+    loop->connect_timeout = g_timeout_add(
+        CONNECT_TIMEOUT, (GSourceFunc)connect_timed_out, dcc);
+  } else {
+    /* if there was an error we have to try again later */
+    connect_failed(dcc);
+  }
+
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+/* thread safe */
+gboolean dropbox_command_client_is_connected(DropboxCommandClient *dcc) {
+  gboolean command_connected;
+
+  g_mutex_lock(&(dcc->command_connected_mutex));
+  command_connected = dcc->command_connected;
+  g_mutex_unlock(&(dcc->command_connected_mutex));
+
+  return command_connected;
+}
+
+/* should only be called in glib main loop */
+void dropbox_command_client_force_reconnect(DropboxCommandClient *dcc) {
+  if (dropbox_command_client_is_connected(dcc) == TRUE) {
+    g_debug("forcing command to reconnect");
+    lose_connection(dcc);
+  }
+}
+
+/* thread safe */
+void dropbox_command_client_request(DropboxCommandClient *dcc,
+                                    DropboxCommand *dc) {
+  DropboxCommand *shed;
+
+  if ((shed = dropbox_command_queue_push(dcc, dc)) != NULL) {
+    g_async_queue_push(dcc->loop->shed, shed);
+  }
+
+  /* never run the request right here, callers like update_file_info
+     don't expect their handler before they return */
+  if (g_atomic_int_compare_and_exchange(&(dcc->loop->run_idle), FALSE, TRUE)) {
+    g_idle_add((GSourceFunc)run_requests, dcc);
+  }
+}
+
+/* should only be called once on initialization */
+void dropbox_command_client_setup(DropboxCommandClient *dcc,
+                                  const gchar *socket_path) {
+  dcc->socket_path = g_strdup(socket_path);
+  dropbox_command_queue_init(dcc);
+  /* the thread's, unused here */
+  dcc->file_info_response_queue = NULL;
+  dcc->file_info_response_idle = FALSE;
+  g_mutex_init(&(dcc->command_connected_mutex));
+  dcc->command_connected = FALSE;
+  dcc->ca_hooklist = NULL;
+  dcc->binary_framing = FALSE;
+  dcc->framing_refused = FALSE;
+  dcc->request_id = 0;
+
+  dcc->loop = g_new0(DropboxCommandLoop, 1);
+  dcc->loop->inbuf = g_string_new(NULL);
+  dcc->loop->outbuf = g_string_new(NULL);
+  dcc->loop->connection_attempts = 1;
+  dcc->loop->reply_state = REPLY_NONE;
+  dcc->loop->shed = g_async_queue_new();
+
+  dropbox_recorder_init();
+
+  g_hook_list_init(&(dcc->ondisconnect_hooklist), sizeof(GHook));
+  g_hook_list_init(&(dcc->onconnect_hooklist), sizeof(GHook));
+}
+
+void dropbox_command_client_add_on_disconnect_hook(
+    DropboxCommandClient *dcc, DropboxCommandClientConnectHook dhcch,
+    gpointer ud) {
+  GHook *newhook;
+
+  newhook = g_hook_alloc(&(dcc->ondisconnect_hooklist));
+  newhook->func = dhcch;
+  newhook->data = ud;
+
+  g_hook_append(&(dcc->ondisconnect_hooklist), newhook);
+}
+
+void dropbox_command_client_add_on_connect_hook(
+    DropboxCommandClient *dcc, DropboxCommandClientConnectHook dhcch,
+    gpointer ud) {
+  GHook *newhook;
+
+  newhook = g_hook_alloc(&(dcc->onconnect_hooklist));
+  newhook->func = dhcch;
+  newhook->data = ud;
+
+  g_hook_append(&(dcc->onconnect_hooklist), newhook);
+}
+
+void dropbox_command_client_add_connection_attempt_hook(
+    DropboxCommandClient *dcc, DropboxCommandClientConnectionAttemptHook dhcch,
+    gpointer ud) {
+  DropboxCommandClientConnectionAttempt *newhook;
+
+  newhook = g_new(DropboxCommandClientConnectionAttempt, 1);
+  newhook->h = dhcch;
+  newhook->ud = ud;
+
+  dcc->ca_hooklist = g_list_append(dcc->ca_hooklist, newhook);
+}
+
+/* should only be called once on initialization */
+void dropbox_command_client_start(DropboxCommandClient *dcc) {
+  g_debug("starting command client");
+  try_to_connect(dcc);
+}
+
+/* thread safe */
+void dropbox_command_client_send_simple_command(DropboxCommandClient *dcc,
+                                                const char *command) {
+  DropboxGeneralCommand *dgc;
+
+  dgc = g_new(DropboxGeneralCommand, 1);
+
+  dgc->dc.request_type = GENERAL_COMMAND;
+  dgc->command_name = g_strdup(command);
+  dgc->command_args = NULL;
+  dgc->handler = NULL;
+  dgc->handler_ud = NULL;
+
+  dropbox_command_client_request(dcc, (DropboxCommand *)dgc);
+}
+
+/* thread safe */
+void dropbox_command_client_send_command(DropboxCommandClient *dcc,
+                                         CajaDropboxCommandResponseHandler h,
+                                         gpointer ud, const char *command,
+                                         ...) {
+  va_list ap;
+  DropboxGeneralCommand *dgc;
+  gchar *na;
+  va_start(ap, command);
+
+  dgc = g_new(DropboxGeneralCommand, 1);
+  dgc->dc.request_type = GENERAL_COMMAND;
+  dgc->command_name = g_strdup(command);
+  dgc->command_args =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+  /* the handler is called on the main loop */
+  dgc->handler = h;
+  dgc->handler_ud = ud;
+
+  while ((na = va_arg(ap, char *)) != NULL) {
+    gchar **arg;
+
+    arg = g_new(gchar *, 2);
+
+    g_hash_table_insert(dgc->command_args, g_strdup(na), arg);
+
+    arg[0] = g_strdup(va_arg(ap, char *));
+    arg[1] = NULL;
+  }
+  va_end(ap);
+
+  dropbox_command_client_request(dcc, (DropboxCommand *)dgc);
+}
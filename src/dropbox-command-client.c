@@ -35,20 +35,15 @@
 #include <unistd.h>
 
 #include "caja-dropbox-hooks.h"
-#include "caja-dropbox.h"
 #include "dropbox-client-util.h"
+#include "dropbox-command-queue.h"
+#include "dropbox-probes.h"
+#include "dropbox-recorder.h"
+#include "dropbox-stats.h"
+#include "dropbox-watchdog.h"
 
 /* TODO: make this asynchronous ;) */
 
-/*
-  this is a tiny hack, necessitated by the fact that
-  finish_file info command is in caja_dropbox,
-  this can be cleaned up once the file_info_command isn't a special
-  case anylonger
-*/
-gboolean caja_dropbox_finish_file_info_command(
-    DropboxFileInfoCommandResponse *);
-
 typedef struct {
   DropboxCommandClient *dcc;
   guint connect_attempt;
@@ -65,18 +60,27 @@ typedef struct {
 } DropboxGeneralCommandResponse;
 
 static gboolean on_connect(DropboxCommandClient *dcc) {
+  dropbox_watchdog_enter("command.connect");
+  dropbox_stats_add("command.connects", 1);
+  DROPBOX_PROBE(connect, "command", dcc->socket_path, 0);
   g_hook_list_invoke(&(dcc->onconnect_hooklist), FALSE);
+  dropbox_watchdog_leave();
   return FALSE;
 }
 
 static gboolean on_disconnect(DropboxCommandClient *dcc) {
+  dropbox_watchdog_enter("command.disconnect");
+  dropbox_stats_add("command.disconnects", 1);
+  DROPBOX_PROBE(disconnect, "command", dcc->socket_path, 0);
   g_hook_list_invoke(&(dcc->ondisconnect_hooklist), FALSE);
+  dropbox_watchdog_leave();
   return FALSE;
 }
 
 static gboolean on_connection_attempt(ConnectionAttempt *ca) {
   GList *ll;
 
+  dropbox_watchdog_enter("command.connection_attempt");
   for (ll = ca->dcc->ca_hooklist; ll != NULL; ll = g_list_next(ll)) {
     DropboxCommandClientConnectionAttempt *dccca =
         (DropboxCommandClientConnectionAttempt *)(ll->data);
@@ -84,10 +88,41 @@ static gboolean on_connection_attempt(ConnectionAttempt *ca) {
   }
 
   g_free(ca);
+  dropbox_watchdog_leave();
 
   return FALSE;
 }
 
+static gboolean finish_file_info_responses(DropboxCommandClient *dcc) {
+  DropboxFileInfoCommandResponse *dficr;
+
+  dropbox_watchdog_enter("command.file_info_replies");
+
+  /* clear this first, anything queued from now on gets another idle */
+  g_atomic_int_set(&(dcc->file_info_response_idle), FALSE);
+
+  /* complete everything that came in since the last time in one go */
+  while ((dficr = g_async_queue_try_pop(dcc->file_info_response_queue)) !=
+         NULL) {
+    dropbox_command_finished(&(dficr->dfic->dc));
+    dficr->dfic->handler(dficr);
+  }
+
+  dropbox_watchdog_leave();
+  return FALSE;
+}
+
+/* thread safe */
+static void queue_file_info_response(DropboxCommandClient *dcc,
+                                     DropboxFileInfoCommandResponse *dficr) {
+  g_async_queue_push(dcc->file_info_response_queue, dficr);
+
+  if (g_atomic_int_compare_and_exchange(&(dcc->file_info_response_idle), FALSE,
+                                        TRUE)) {
+    g_idle_add((GSourceFunc)finish_file_info_responses, dcc);
+  }
+}
+
 static gboolean receive_args_until_done(GIOChannel *chan,
                                         GHashTable *return_table,
                                         GError **err) {
@@ -145,6 +180,101 @@ static gboolean receive_args_until_done(GIOChannel *chan,
   return TRUE;
 }
 
+static gboolean read_exactly(GIOChannel *chan, gchar *buf, gsize count,
+                             GError **err) {
+  while (count > 0) {
+    GIOStatus iostat;
+    gsize bytes_read = 0;
+
+    iostat = g_io_channel_read_chars(chan, buf, count, &bytes_read, err);
+    if (iostat == G_IO_STATUS_ERROR) {
+      return FALSE;
+    } else if (iostat == G_IO_STATUS_AGAIN) {
+      g_set_error(
+          err,
+          g_quark_from_static_string("dropbox command connection timed out"),
+          0, "dropbox command connection timed out");
+      return FALSE;
+    } else if (iostat == G_IO_STATUS_EOF) {
+      g_set_error(
+          err, g_quark_from_static_string("dropbox command connection closed"),
+          0, "dropbox command connection closed");
+      return FALSE;
+    }
+
+    buf += bytes_read;
+    count -= bytes_read;
+  }
+
+  return TRUE;
+}
+
+/* send_command_to_db() once the daemon agreed to binary frames */
+static GHashTable *send_frame_to_db(DropboxCommandClient *dcc,
+                                    GIOChannel *chan, DropboxCommand *dc,
+                                    const gchar *command_name,
+                                    GHashTable *args, GError **err) {
+  GString *buf = g_string_new(NULL);
+  GHashTable *response;
+  DropboxFrameStatus status;
+  guint32 request_id, len;
+  gsize bytes_trans, pos = 0;
+  gchar kind;
+
+  request_id = ++dcc->request_id;
+  dropbox_client_util_append_frame(buf, request_id, DROPBOX_FRAME_COMMAND,
+                                   command_name, args);
+  if (g_io_channel_write_chars(chan, buf->str, buf->len, &bytes_trans, err) !=
+          G_IO_STATUS_NORMAL ||
+      g_io_channel_flush(chan, err) != G_IO_STATUS_NORMAL) {
+    g_string_free(buf, TRUE);
+    return NULL;
+  }
+  dropbox_command_mark(dc, DROPBOX_MARK_WRITTEN);
+
+  /* the length, then the rest of the frame */
+  g_string_set_size(buf, 4);
+  if (read_exactly(chan, buf->str, 4, err) == FALSE) {
+    g_string_free(buf, TRUE);
+    return NULL;
+  }
+  dropbox_command_mark(dc, DROPBOX_MARK_REPLY);
+  memcpy(&len, buf->str, 4);
+  len = GUINT32_FROM_BE(len);
+  if (len > DROPBOX_FRAME_MAX) {
+    g_string_free(buf, TRUE);
+    g_set_error(err, g_quark_from_static_string("parse error"), 0,
+                "frame too big");
+    return NULL;
+  }
+  g_string_set_size(buf, 4 + len);
+  if (read_exactly(chan, buf->str + 4, len, err) == FALSE) {
+    g_string_free(buf, TRUE);
+    return NULL;
+  }
+
+  status = dropbox_client_util_next_frame(buf, &pos, &request_id, &kind, NULL,
+                                          &response);
+  g_string_free(buf, TRUE);
+  if (status == DROPBOX_FRAME_PARSED && request_id != dcc->request_id) {
+    g_hash_table_destroy(response);
+    status = DROPBOX_FRAME_BAD;
+  }
+  if (status != DROPBOX_FRAME_PARSED) {
+    g_set_error(err, g_quark_from_static_string("parse error"), 0,
+                "parse error");
+    return NULL;
+  }
+
+  /* like a text reply that isn't "ok" */
+  if (kind != DROPBOX_FRAME_OK) {
+    g_hash_table_destroy(response);
+    return NULL;
+  }
+
+  return response;
+}
+
 /*
   sends a command to the dropbox server
   returns an hash of the return values
@@ -153,9 +283,10 @@ static gboolean receive_args_until_done(GIOChannel *chan,
   but it doesn't matter right now, any error is a sufficient
   condition to disconnect
 */
-static GHashTable *send_command_to_db(GIOChannel *chan,
-                                      const gchar *command_name,
-                                      GHashTable *args, GError **err) {
+static GHashTable *send_line_command_to_db(GIOChannel *chan,
+                                           DropboxCommand *dc,
+                                           const gchar *command_name,
+                                           GHashTable *args, GError **err) {
   GError *tmp_error = NULL;
   GIOStatus iostat;
   gsize bytes_trans;
@@ -164,71 +295,32 @@ static GHashTable *send_command_to_db(GIOChannel *chan,
   g_assert(chan != NULL);
   g_assert(command_name != NULL);
 
-#define WRITE_OR_DIE_SANI(s, l)                                              \
-  {                                                                          \
-    gchar *sani_s;                                                           \
-    sani_s = dropbox_client_util_sanitize(s);                                \
-    iostat =                                                                 \
-        g_io_channel_write_chars(chan, sani_s, l, &bytes_trans, &tmp_error); \
-    g_free(sani_s);                                                          \
-    if (iostat == G_IO_STATUS_ERROR || iostat == G_IO_STATUS_AGAIN) {        \
-      if (tmp_error != NULL) {                                               \
-        g_propagate_error(err, tmp_error);                                   \
-      }                                                                      \
-      return NULL;                                                           \
-    }                                                                        \
-  }
-
-#define WRITE_OR_DIE(s, l)                                                   \
-  {                                                                          \
-    iostat = g_io_channel_write_chars(chan, s, l, &bytes_trans, &tmp_error); \
-    if (iostat == G_IO_STATUS_ERROR || iostat == G_IO_STATUS_AGAIN) {        \
-      if (tmp_error != NULL) {                                               \
-        g_propagate_error(err, tmp_error);                                   \
-      }                                                                      \
-      return NULL;                                                           \
-    }                                                                        \
-  }
-
-  /* send command to server */
-  WRITE_OR_DIE_SANI(command_name, -1);
-  WRITE_OR_DIE("\n", -1);
-
-  if (args != NULL) {
-    GList *keys, *li;
-
-    keys = g_hash_table_get_keys(args);
-
-    for (li = keys; li != NULL; li = g_list_next(li)) {
-      int i;
-      gchar **value;
-
-      WRITE_OR_DIE_SANI((gchar *)li->data, -1);
-
-      value = g_hash_table_lookup(args, li->data);
-      for (i = 0; value[i] != NULL; i++) {
-        WRITE_OR_DIE("\t", -1);
-        WRITE_OR_DIE_SANI(value[i], -1);
+  /* send command to server, in one write */
+  {
+    GString *out = g_string_new(NULL);
+
+    dropbox_client_util_append_command(out, command_name, args);
+    iostat = g_io_channel_write_chars(chan, out->str, out->len, &bytes_trans,
+                                      &tmp_error);
+    g_string_free(out, TRUE);
+    if (iostat == G_IO_STATUS_ERROR || iostat == G_IO_STATUS_AGAIN) {
+      if (tmp_error != NULL) {
+        g_propagate_error(err, tmp_error);
       }
-      WRITE_OR_DIE("\n", -1);
+      return NULL;
     }
-
-    g_list_free(keys);
   }
 
-  WRITE_OR_DIE("done\n", -1);
-
-#undef WRITE_OR_DIE
-#undef WRITE_OR_DIE_SANI
-
   g_io_channel_flush(chan, &tmp_error);
   if (tmp_error != NULL) {
     g_propagate_error(err, tmp_error);
     return NULL;
   }
+  dropbox_command_mark(dc, DROPBOX_MARK_WRITTEN);
 
   /* now we have to read the data */
   iostat = g_io_channel_read_line(chan, &line, NULL, NULL, &tmp_error);
+  dropbox_command_mark(dc, DROPBOX_MARK_REPLY);
   if (iostat == G_IO_STATUS_ERROR) {
     g_assert(line == NULL);
     g_propagate_error(err, tmp_error);
@@ -303,30 +395,45 @@ static GHashTable *send_command_to_db(GIOChannel *chan,
   }
 }
 
-static void do_file_info_command(GIOChannel *chan, DropboxFileInfoCommand *dfic,
-                                 GError **gerr) {
+/* dc is the request the command is for, NULL if it's our own */
+static GHashTable *send_command_to_db(DropboxCommandClient *dcc,
+                                      GIOChannel *chan, DropboxCommand *dc,
+                                      const gchar *command_name,
+                                      GHashTable *args, GError **err) {
+  gint64 start = g_get_monotonic_time();
+  GHashTable *response;
+  guint32 sequence;
+
+  sequence = dropbox_recorder_command(dcc->socket_path, command_name, args);
+  DROPBOX_PROBE(command__send, command_name,
+                dc != NULL ? dropbox_command_path(dc) : NULL,
+                dc != NULL ? dc->id : 0);
+  dropbox_command_mark(dc, DROPBOX_MARK_SEND);
+  response =
+      dcc->binary_framing
+          ? send_frame_to_db(dcc, chan, dc, command_name, args, err)
+          : send_line_command_to_db(chan, dc, command_name, args, err);
+  dropbox_command_mark(dc, DROPBOX_MARK_DONE);
+  DROPBOX_PROBE(command__reply, command_name,
+                dc != NULL ? dropbox_command_path(dc) : NULL,
+                dc != NULL ? dc->id : 0);
+  if (sequence != 0 && (err == NULL || *err == NULL)) {
+    dropbox_recorder_reply(dcc->socket_path, sequence, response);
+  }
+
+  dropbox_stats_record_since(command_name, DROPBOX_STATS_SOCKET, start);
+  return response;
+}
+
+static void do_file_info_command(DropboxCommandClient *dcc, GIOChannel *chan,
+                                 DropboxFileInfoCommand *dfic, GError **gerr) {
   /* we need to send two requests to dropbox:
      file status, and folder_tags */
   GError *tmp_gerr = NULL;
   DropboxFileInfoCommandResponse *dficr;
   GHashTable *file_status_response = NULL, *args, *folder_tag_response = NULL,
              *emblems_response = NULL;
-  gchar *filename = NULL;
-
-  {
-    gchar *filename_un, *uri;
-    uri = caja_file_info_get_uri(dfic->file);
-    filename_un = uri ? g_filename_from_uri(uri, NULL, NULL) : NULL;
-    g_free(uri);
-    if (filename_un) {
-      filename = g_filename_to_utf8(filename_un, -1, NULL, NULL, NULL);
-      g_free(filename_un);
-      if (filename == NULL) {
-        /* oooh, filename wasn't correctly encoded. mark as  */
-        g_debug("file wasn't correctly encoded %s", filename_un);
-      }
-    }
-  }
+  const gchar *filename = dfic->path;
 
   if (filename == NULL) {
     /* We couldn't get the filename.  Just return empty. */
@@ -344,26 +451,29 @@ static void do_file_info_command(GIOChannel *chan, DropboxFileInfoCommand *dfic,
     g_hash_table_insert(args, g_strdup("path"), path_arg);
   }
 
-  emblems_response = send_command_to_db(chan, "get_emblems", args, NULL);
+  emblems_response = send_command_to_db(dcc, chan, &(dfic->dc), "get_emblems",
+                                        args, NULL);
   if (emblems_response) {
     /* Don't need to do the other calls. */
     g_hash_table_unref(args);
     goto exit;
   }
 
+  dropbox_stats_add("file_info.fallbacks", 1);
+
   /* send status command to server */
   file_status_response =
-      send_command_to_db(chan, "icon_overlay_file_status", args, &tmp_gerr);
+      send_command_to_db(dcc, chan, &(dfic->dc), "icon_overlay_file_status",
+                         args, &tmp_gerr);
   g_hash_table_unref(args);
   args = NULL;
   if (tmp_gerr != NULL) {
-    g_free(filename);
     g_assert(file_status_response == NULL);
     g_propagate_error(gerr, tmp_gerr);
     return;
   }
 
-  if (caja_file_info_is_directory(dfic->file)) {
+  if (dfic->is_dir) {
     args = g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
                                  (GDestroyNotify)g_free,
                                  (GDestroyNotify)g_strfreev);
@@ -376,7 +486,8 @@ static void do_file_info_command(GIOChannel *chan, DropboxFileInfoCommand *dfic,
     }
 
     folder_tag_response =
-        send_command_to_db(chan, "get_folder_tag", args, &tmp_gerr);
+        send_command_to_db(dcc, chan, &(dfic->dc), "get_folder_tag", args,
+                           &tmp_gerr);
     g_hash_table_unref(args);
     args = NULL;
     if (tmp_gerr != NULL) {
@@ -392,19 +503,20 @@ static void do_file_info_command(GIOChannel *chan, DropboxFileInfoCommand *dfic,
      now let's get this request done,
      ...in the glib main loop */
 exit:
+  dropbox_command_replied(&(dfic->dc));
   dficr = g_new0(DropboxFileInfoCommandResponse, 1);
   dficr->dfic = dfic;
   dficr->folder_tag_response = folder_tag_response;
   dficr->file_status_response = file_status_response;
   dficr->emblems_response = emblems_response;
-  g_idle_add((GSourceFunc)caja_dropbox_finish_file_info_command, dficr);
-
-  g_free(filename);
+  queue_file_info_response(dcc, dficr);
 
   return;
 }
 
 static gboolean finish_general_command(DropboxGeneralCommandResponse *dgcr) {
+  dropbox_command_finished(&(dgcr->dgc->dc));
+
   if (dgcr->dgc->handler != NULL) {
     dgcr->dgc->handler(dgcr->response, dgcr->dgc->handler_ud);
   }
@@ -423,14 +535,14 @@ static gboolean finish_general_command(DropboxGeneralCommandResponse *dgcr) {
   return FALSE;
 }
 
-static void do_general_command(GIOChannel *chan, DropboxGeneralCommand *dcac,
-                               GError **gerr) {
+static void do_general_command(DropboxCommandClient *dcc, GIOChannel *chan,
+                               DropboxGeneralCommand *dcac, GError **gerr) {
   GError *tmp_gerr = NULL;
   GHashTable *response;
 
   /* send status command to server */
-  response = send_command_to_db(chan, dcac->command_name, dcac->command_args,
-                                &tmp_gerr);
+  response = send_command_to_db(dcc, chan, &(dcac->dc), dcac->command_name,
+                                dcac->command_args, &tmp_gerr);
   if (tmp_gerr != NULL) {
     g_assert(response == NULL);
     g_propagate_error(gerr, tmp_gerr);
@@ -439,6 +551,7 @@ static void do_general_command(GIOChannel *chan, DropboxGeneralCommand *dcac,
 
   /* great, the server did the command perfectly,
      now call the handler with the response */
+  dropbox_command_replied(&(dcac->dc));
   {
     DropboxGeneralCommandResponse *dgcr =
         g_new0(DropboxGeneralCommandResponse, 1);
@@ -478,11 +591,61 @@ static gboolean check_connection(GIOChannel *chan) {
   return iostat == G_IO_STATUS_AGAIN;
 }
 
-static gpointer dropbox_command_client_thread(DropboxCommandClient *data);
+/* offers binary frames to the daemon, FALSE if the connection broke */
+static gboolean negotiate_framing(DropboxCommandClient *dcc, GIOChannel *chan) {
+  GHashTable *args, *response;
+  GError *gerr = NULL;
+  gchar **framings;
 
-static void end_request(DropboxCommand *dc) {
-  if ((gpointer(*)(DropboxCommandClient * data))
-          dc != &dropbox_command_client_thread) {
+  dcc->binary_framing = FALSE;
+  if (dcc->framing_refused) {
+    return TRUE;
+  }
+
+  args =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+  framings = g_new(gchar *, 2);
+  framings[0] = g_strdup(DROPBOX_FRAMING_BINARY);
+  framings[1] = NULL;
+  g_hash_table_insert(args, g_strdup("framings"), framings);
+
+  response =
+      send_command_to_db(dcc, chan, NULL, DROPBOX_FRAMING_COMMAND, args,
+                         &gerr);
+  g_hash_table_unref(args);
+
+  if (gerr != NULL) {
+    /* maybe it hung up on a command it didn't know, stick to text */
+    g_debug("framing error: %s", gerr->message);
+    g_error_free(gerr);
+    dcc->framing_refused = TRUE;
+    return FALSE;
+  }
+
+  if (response != NULL &&
+      (framings = g_hash_table_lookup(response, "framing")) != NULL &&
+      strcmp(framings[0], DROPBOX_FRAMING_BINARY) == 0) {
+    g_debug("using binary frames");
+    dcc->binary_framing = TRUE;
+  } else {
+    dcc->framing_refused = TRUE;
+  }
+
+  if (response != NULL) {
+    g_hash_table_unref(response);
+  }
+  return TRUE;
+}
+
+/* not a real request, it only makes the thread reconnect.  It is shared by
+   every instance and thread, so it only ever goes in as a marker, which
+   leaves it untouched */
+static DropboxCommand reconnect_request = {GENERAL_COMMAND};
+
+static void end_request(DropboxCommandClient *dcc, DropboxCommand *dc) {
+  if (dc != &reconnect_request) {
+    dropbox_stats_add("commands.unanswered", 1);
     switch (dc->request_type) {
       case GET_FILE_INFO: {
         DropboxFileInfoCommand *dfic = (DropboxFileInfoCommand *)dc;
@@ -491,7 +654,7 @@ static void end_request(DropboxCommand *dc) {
         dficr->dfic = dfic;
         dficr->file_status_response = NULL;
         dficr->emblems_response = NULL;
-        g_idle_add((GSourceFunc)caja_dropbox_finish_file_info_command, dficr);
+        queue_file_info_response(dcc, dficr);
       } break;
       case GENERAL_COMMAND: {
         DropboxGeneralCommand *dgc = (DropboxGeneralCommand *)dc;
@@ -515,8 +678,7 @@ static gpointer dropbox_command_client_thread(DropboxCommandClient *dcc) {
 
   /* intialize address structure */
   addr.sun_family = AF_UNIX;
-  g_snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/.dropbox/command_socket",
-             g_get_home_dir());
+  g_strlcpy(addr.sun_path, dcc->socket_path, sizeof(addr.sun_path));
   addr_len = sizeof(addr) - sizeof(addr.sun_path) + strlen(addr.sun_path);
 
   while (1) {
@@ -612,6 +774,13 @@ static gpointer dropbox_command_client_thread(DropboxCommandClient *dcc) {
     chan = g_io_channel_unix_new(sock);
     g_io_channel_set_close_on_unref(chan, TRUE);
     g_io_channel_set_line_term(chan, "\n", -1);
+    /* frames are raw bytes */
+    g_io_channel_set_encoding(chan, NULL, NULL);
+
+    if (negotiate_framing(dcc, chan) == FALSE) {
+      g_io_channel_unref(chan);
+      continue;
+    }
 
 #define SET_CONNECTED_STATE(s)                       \
   {                                                  \
@@ -629,7 +798,7 @@ static gpointer dropbox_command_client_thread(DropboxCommandClient *dcc) {
 
       while (1) {
         /* get a request from caja */
-        dc = g_async_queue_timeout_pop(dcc->command_queue, G_USEC_PER_SEC / 10);
+        dc = dropbox_command_queue_pop(dcc, G_USEC_PER_SEC / 10);
         if (dc != NULL) {
           break;
         } else {
@@ -639,21 +808,21 @@ static gpointer dropbox_command_client_thread(DropboxCommandClient *dcc) {
         }
       }
 
-      /* this pointer should be unique */
-      if ((gpointer(*)(DropboxCommandClient * data))
-              dc == &dropbox_command_client_thread) {
+      if (dc == &reconnect_request) {
         g_debug("got a reset request");
         goto BADCONNECTION;
       }
 
+      dropbox_command_started(dc);
+
       switch (dc->request_type) {
         case GET_FILE_INFO: {
           g_debug("doing file info command");
-          do_file_info_command(chan, (DropboxFileInfoCommand *)dc, &gerr);
+          do_file_info_command(dcc, chan, (DropboxFileInfoCommand *)dc, &gerr);
         } break;
         case GENERAL_COMMAND: {
           g_debug("doing general command");
-          do_general_command(chan, (DropboxGeneralCommand *)dc, &gerr);
+          do_general_command(dcc, chan, (DropboxGeneralCommand *)dc, &gerr);
         } break;
         default:
           g_assert_not_reached();
@@ -665,7 +834,8 @@ static gpointer dropbox_command_client_thread(DropboxCommandClient *dcc) {
       if (gerr != NULL) {
         g_debug("COMMAND ERROR*****************************");
         /* mark this request as never to be completed */
-        end_request(dc);
+        dropbox_command_replied(dc);
+        end_request(dcc, dc);
 
         g_debug("command error: %s", gerr->message);
 
@@ -673,8 +843,8 @@ static gpointer dropbox_command_client_thread(DropboxCommandClient *dcc) {
       BADCONNECTION:
         /* grab all the rest of the data off the async queue and mark it
            never to be completed, who knows how long we'll be disconnected */
-        while ((dc = g_async_queue_try_pop(dcc->command_queue)) != NULL) {
-          end_request(dc);
+        while ((dc = dropbox_command_queue_pop(dcc, 0)) != NULL) {
+          end_request(dcc, dc);
         }
 
         g_io_channel_unref(chan);
@@ -709,23 +879,36 @@ gboolean dropbox_command_client_is_connected(DropboxCommandClient *dcc) {
 void dropbox_command_client_force_reconnect(DropboxCommandClient *dcc) {
   if (dropbox_command_client_is_connected(dcc) == TRUE) {
     g_debug("forcing command to reconnect");
-    dropbox_command_client_request(
-        dcc, (DropboxCommand *)&dropbox_command_client_thread);
+    dropbox_command_queue_push_marker(dcc, &reconnect_request);
   }
 }
 
 /* thread safe */
 void dropbox_command_client_request(DropboxCommandClient *dcc,
                                     DropboxCommand *dc) {
-  g_async_queue_push(dcc->command_queue, dc);
+  DropboxCommand *shed;
+
+  if ((shed = dropbox_command_queue_push(dcc, dc)) != NULL) {
+    end_request(dcc, shed);
+  }
 }
 
 /* should only be called once on initialization */
-void dropbox_command_client_setup(DropboxCommandClient *dcc) {
-  dcc->command_queue = g_async_queue_new();
+void dropbox_command_client_setup(DropboxCommandClient *dcc,
+                                  const gchar *socket_path) {
+  dcc->socket_path = g_strdup(socket_path);
+  dropbox_command_queue_init(dcc);
+  dcc->file_info_response_queue = g_async_queue_new();
+  dcc->file_info_response_idle = FALSE;
   g_mutex_init(&(dcc->command_connected_mutex));
   dcc->command_connected = FALSE;
   dcc->ca_hooklist = NULL;
+  dcc->binary_framing = FALSE;
+  dcc->framing_refused = FALSE;
+  dcc->request_id = 0;
+  dcc->loop = NULL;
+
+  dropbox_recorder_init();
 
   g_hook_list_init(&(dcc->ondisconnect_hooklist), sizeof(GHook));
   g_hook_list_init(&(dcc->onconnect_hooklist), sizeof(GHook));
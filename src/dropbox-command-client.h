@@ -24,8 +24,7 @@
 #ifndef DROPBOX_COMMAND_CLIENT_H
 #define DROPBOX_COMMAND_CLIENT_H
 
-#include <libcaja-extension/caja-file-info.h>
-#include <libcaja-extension/caja-info-provider.h>
+#include <glib.h>
 
 G_BEGIN_DECLS
 
@@ -34,22 +33,55 @@ typedef enum { GET_FILE_INFO, GENERAL_COMMAND } CajaDropboxRequestType;
 
 typedef struct {
   CajaDropboxRequestType request_type;
+  /* unique in the process, set when the request is queued */
+  guint32 id;
+  /* monotonic times for dropbox-stats.h, set by the command client */
+  gint64 queued_time;
+  gint64 started_time;
+  gint64 replied_time;
+  /* picked for the slow request log, which also wants the time spent
+     writing, waiting for the daemon and reading, see
+     dropbox_command_mark() */
+  gboolean sampled;
+  guint round_trips;
+  gint64 mark_time;
+  gint64 write_usec;
+  gint64 daemon_usec;
+  gint64 read_usec;
 } DropboxCommand;
 
+/* past this many queued requests the oldest file info lookup is answered
+   as unknown to make room, background lookups go before the ones caja
+   waits on and general commands are never dropped */
+#define DROPBOX_COMMAND_QUEUE_LIMIT 2048
+
+typedef struct _DropboxFileInfoCommandResponse DropboxFileInfoCommandResponse;
+
+/* called on the main loop, owns the response and its command */
+typedef void (*DropboxFileInfoCommandHandler)(DropboxFileInfoCommandResponse *);
+
+/* callers that need more state embed this at the start of their own
+   struct, like the commands embed DropboxCommand */
 typedef struct {
   DropboxCommand dc;
-  CajaInfoProvider *provider;
-  GClosure *update_complete;
-  CajaFileInfo *file;
-  gboolean cancelled;
+  /* canonical UTF-8 path, owned by the command */
+  gchar *path;
+  /* ask for the folder tag too, if the daemon has no emblems for us */
+  gboolean is_dir;
+  /* nobody waits on it, it is shed before any other lookup */
+  gboolean background;
+  /* set by the command client when it dropped the lookup to make room,
+     the response is empty then */
+  gboolean shed;
+  DropboxFileInfoCommandHandler handler;
 } DropboxFileInfoCommand;
 
-typedef struct {
+struct _DropboxFileInfoCommandResponse {
   DropboxFileInfoCommand *dfic;
   GHashTable *file_status_response;
   GHashTable *folder_tag_response;
   GHashTable *emblems_response;
-} DropboxFileInfoCommandResponse;
+};
 
 typedef void (*CajaDropboxCommandResponseHandler)(GHashTable *, gpointer);
 
@@ -65,12 +97,32 @@ typedef void (*DropboxCommandClientConnectionAttemptHook)(guint, gpointer);
 typedef GHookFunc DropboxCommandClientConnectHook;
 
 typedef struct {
+  gchar *socket_path;
   GMutex command_connected_mutex;
   gboolean command_connected;
   GAsyncQueue *command_queue;
+  /* the file info commands in command_queue, oldest first, under its
+     lock.  background ones are kept apart so they can be shed first */
+  GQueue queued_lookups;
+  GQueue queued_background;
+  /* 0 for no limit */
+  guint queue_limit;
+  guint queue_peak;
+  guint requests_shed;
+  /* finished file info commands waiting for the main loop */
+  GAsyncQueue *file_info_response_queue;
+  gint file_info_response_idle;
   GList *ca_hooklist;
   GHookList onconnect_hooklist;
   GHookList ondisconnect_hooklist;
+  /* the connection talks in binary frames, see dropbox-client-util.h */
+  gboolean binary_framing;
+  /* the daemon didn't take the framing command, don't offer it again */
+  gboolean framing_refused;
+  guint32 request_id;
+  /* socket state of the main loop client (--enable-mainloop-command-client),
+     private to dropbox-command-client-mainloop.c */
+  struct _DropboxCommandLoop *loop;
 } DropboxCommandClient;
 
 gboolean dropbox_command_client_is_connected(DropboxCommandClient *dcc);
@@ -80,7 +132,12 @@ void dropbox_command_client_force_reconnect(DropboxCommandClient *dcc);
 void dropbox_command_client_request(DropboxCommandClient *dcc,
                                     DropboxCommand *dc);
 
-void dropbox_command_client_setup(DropboxCommandClient *dcc);
+void dropbox_command_client_get_queue_stats(DropboxCommandClient *dcc,
+                                            guint *depth, guint *peak,
+                                            guint *shed);
+
+void dropbox_command_client_setup(DropboxCommandClient *dcc,
+                                  const gchar *socket_path);
 
 void dropbox_command_client_start(DropboxCommandClient *dcc);
 
@@ -0,0 +1,286 @@
+/*
+ * dropbox-command-queue.c
+ * The request queue of the command clients.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "dropbox-command-queue.h"
+#include "dropbox-probes.h"
+#include "dropbox-stats.h"
+
+/*
+  Every queued request pins its file and closure until it is answered, so
+  while the daemon is slow the queue can't be allowed to grow with every
+  file caja shows.  File info lookups are the ones that can wait, once the
+  queue is full the oldest of them makes room for the new request: first
+  the background ones, revalidations nobody is looking at, and only when
+  there are none of those a lookup caja waits on.  Its handler sees shed
+  set and can ask again later.  General commands come from the user
+  clicking on something, they always get in.
+
+  The lookups are also kept in queued_background and queued_lookups, in
+  the order they were pushed.  command_queue is first in first out, so a
+  lookup that is popped is always the head of one of them.
+*/
+
+/*
+  The slow request log, off unless CAJA_DROPBOX_SLOW_MS is set.  Requests
+  that take at least that many milliseconds from being queued to their
+  handler are logged with where the time went.  With CAJA_DROPBOX_SLOW_SAMPLE
+  set to n only every nth request is timed and considered.
+*/
+static gint64 slow_threshold = -1;
+static guint slow_sample = 1;
+static gint slow_counter;
+
+static gint last_id;
+
+static void read_slow_log_config(void) {
+  static gsize initialized = 0;
+
+  if (g_once_init_enter(&initialized)) {
+    const gchar *ms = g_getenv("CAJA_DROPBOX_SLOW_MS");
+    const gchar *sample = g_getenv("CAJA_DROPBOX_SLOW_SAMPLE");
+
+    if (ms != NULL && *ms != '\0') {
+      slow_threshold = MAX(atoi(ms), 0) * (gint64)1000;
+    }
+    if (sample != NULL && atoi(sample) > 1) {
+      slow_sample = atoi(sample);
+    }
+    g_once_init_leave(&initialized, 1);
+  }
+}
+
+void dropbox_command_queue_init(DropboxCommandClient *dcc) {
+  read_slow_log_config();
+  dcc->command_queue = g_async_queue_new();
+  g_queue_init(&(dcc->queued_lookups));
+  g_queue_init(&(dcc->queued_background));
+  dcc->queue_limit = DROPBOX_COMMAND_QUEUE_LIMIT;
+  dcc->queue_peak = 0;
+  dcc->requests_shed = 0;
+}
+
+static guint queue_depth(DropboxCommandClient *dcc) {
+  /* negative while the thread is waiting for a request */
+  return MAX(g_async_queue_length_unlocked(dcc->command_queue), 0);
+}
+
+/* thread safe, returns the lookup that was dropped to make room, the
+   caller has to answer it */
+DropboxCommand *dropbox_command_queue_push(DropboxCommandClient *dcc,
+                                           DropboxCommand *dc) {
+  DropboxCommand *shed = NULL;
+  guint depth;
+
+  g_async_queue_lock(dcc->command_queue);
+
+  if (dcc->queue_limit > 0 && queue_depth(dcc) >= dcc->queue_limit &&
+      ((shed = g_queue_pop_head(&(dcc->queued_background))) != NULL ||
+       (shed = g_queue_pop_head(&(dcc->queued_lookups))) != NULL)) {
+    g_async_queue_remove_unlocked(dcc->command_queue, shed);
+    ((DropboxFileInfoCommand *)shed)->shed = TRUE;
+    dcc->requests_shed++;
+  }
+
+  if (dc->request_type == GET_FILE_INFO) {
+    DropboxFileInfoCommand *dfic = (DropboxFileInfoCommand *)dc;
+
+    dfic->shed = FALSE;
+    g_queue_push_tail(dfic->background ? &(dcc->queued_background)
+                                       : &(dcc->queued_lookups),
+                      dc);
+  }
+  dc->id = (guint32)g_atomic_int_add(&last_id, 1) + 1;
+  dc->queued_time = g_get_monotonic_time();
+  dc->started_time = dc->replied_time = 0;
+  dc->sampled =
+      slow_threshold >= 0 &&
+      (guint)g_atomic_int_add(&slow_counter, 1) % slow_sample == 0;
+  dc->round_trips = 0;
+  dc->mark_time = dc->write_usec = dc->daemon_usec = dc->read_usec = 0;
+  g_async_queue_push_unlocked(dcc->command_queue, dc);
+
+  depth = queue_depth(dcc);
+  if (depth > dcc->queue_peak) {
+    dcc->queue_peak = depth;
+  }
+
+  g_async_queue_unlock(dcc->command_queue);
+
+  DROPBOX_PROBE(request__enqueue, dropbox_command_stats_name(dc),
+                dropbox_command_path(dc), dc->id);
+
+  if (shed != NULL) {
+    g_debug("command queue full, dropping lookup of %s",
+            ((DropboxFileInfoCommand *)shed)->path);
+    DROPBOX_PROBE(request__shed, "file_info",
+                  ((DropboxFileInfoCommand *)shed)->path, shed->id);
+    dropbox_stats_add("command_queue.shed", 1);
+  } else {
+    dropbox_stats_add("command_queue.depth", 1);
+  }
+
+  return shed;
+}
+
+/* thread safe, for markers the client thread acts on itself and never
+   answers, like the reconnect request: they are neither stamped nor
+   counted as lookups and never make room, so nothing is shed for them */
+void dropbox_command_queue_push_marker(DropboxCommandClient *dcc,
+                                       DropboxCommand *dc) {
+  g_async_queue_push(dcc->command_queue, dc);
+  dropbox_stats_add("command_queue.depth", 1);
+}
+
+/* thread safe, waits up to timeout microseconds, 0 doesn't wait */
+DropboxCommand *dropbox_command_queue_pop(DropboxCommandClient *dcc,
+                                          guint64 timeout) {
+  DropboxCommand *dc;
+
+  g_async_queue_lock(dcc->command_queue);
+
+  if (timeout > 0) {
+    dc = g_async_queue_timeout_pop_unlocked(dcc->command_queue, timeout);
+  } else {
+    dc = g_async_queue_try_pop_unlocked(dcc->command_queue);
+  }
+
+  if (dc != NULL && dc == g_queue_peek_head(&(dcc->queued_lookups))) {
+    g_queue_pop_head(&(dcc->queued_lookups));
+  } else if (dc != NULL &&
+             dc == g_queue_peek_head(&(dcc->queued_background))) {
+    g_queue_pop_head(&(dcc->queued_background));
+  }
+
+  g_async_queue_unlock(dcc->command_queue);
+
+  if (dc != NULL) {
+    dropbox_stats_add("command_queue.depth", -1);
+  }
+
+  return dc;
+}
+
+const gchar *dropbox_command_stats_name(DropboxCommand *dc) {
+  return dc->request_type == GET_FILE_INFO
+             ? "file_info"
+             : ((DropboxGeneralCommand *)dc)->command_name;
+}
+
+void dropbox_command_started(DropboxCommand *dc) {
+  dc->started_time = g_get_monotonic_time();
+  dropbox_stats_record(dropbox_command_stats_name(dc), DROPBOX_STATS_QUEUE,
+                       dc->started_time - dc->queued_time);
+  dropbox_stats_add("commands.in_flight", 1);
+  DROPBOX_PROBE(request__dequeue, dropbox_command_stats_name(dc),
+                dropbox_command_path(dc), dc->id);
+}
+
+void dropbox_command_mark(DropboxCommand *dc, DropboxCommandMark mark) {
+  gint64 now;
+
+  if (dc == NULL || !dc->sampled) {
+    return;
+  }
+
+  now = g_get_monotonic_time();
+  switch (mark) {
+    case DROPBOX_MARK_SEND:
+      dc->round_trips++;
+      break;
+    case DROPBOX_MARK_WRITTEN:
+      dc->write_usec += now - dc->mark_time;
+      break;
+    case DROPBOX_MARK_REPLY:
+      dc->daemon_usec += now - dc->mark_time;
+      break;
+    case DROPBOX_MARK_DONE:
+      dc->read_usec += now - dc->mark_time;
+      break;
+  }
+  dc->mark_time = now;
+}
+
+void dropbox_command_replied(DropboxCommand *dc) {
+  dc->replied_time = g_get_monotonic_time();
+  dropbox_stats_add("commands.in_flight", -1);
+}
+
+const gchar *dropbox_command_path(DropboxCommand *dc) {
+  DropboxGeneralCommand *dgc = (DropboxGeneralCommand *)dc;
+  gchar **paths = NULL;
+
+  if (dc->request_type == GET_FILE_INFO) {
+    return ((DropboxFileInfoCommand *)dc)->path;
+  }
+
+  if (dgc->command_args != NULL &&
+      (paths = g_hash_table_lookup(dgc->command_args, "paths")) == NULL) {
+    paths = g_hash_table_lookup(dgc->command_args, "path");
+  }
+  return paths != NULL ? paths[0] : NULL;
+}
+
+#define MS(usec) ((usec) / 1000.0)
+
+void dropbox_command_finished(DropboxCommand *dc) {
+  gint64 now = g_get_monotonic_time();
+  const gchar *path;
+
+  /* never got to the daemon, it was dropped or the connection went away */
+  if (dc->replied_time == 0) {
+    dc->replied_time = now;
+  }
+  if (dc->started_time == 0) {
+    dc->started_time = dc->replied_time;
+  }
+
+  dropbox_stats_record(dropbox_command_stats_name(dc), DROPBOX_STATS_DELIVERY,
+                       now - dc->replied_time);
+  DROPBOX_PROBE(request__done, dropbox_command_stats_name(dc),
+                dropbox_command_path(dc), dc->id);
+
+  if (dc->sampled && now - dc->queued_time >= slow_threshold) {
+    path = dropbox_command_path(dc);
+    g_message(
+        "slow request: %s %s took %.1f ms (queued %.1f, writing %.1f, "
+        "daemon %.1f, reading %.1f, delivery %.1f), round trips: %u",
+        dropbox_command_stats_name(dc), path != NULL ? path : "",
+        MS(now - dc->queued_time), MS(dc->started_time - dc->queued_time),
+        MS(dc->write_usec), MS(dc->daemon_usec), MS(dc->read_usec),
+        MS(now - dc->replied_time), dc->round_trips);
+    dropbox_stats_add("commands.slow", 1);
+  }
+}
+
+#undef MS
+
+/* thread safe */
+void dropbox_command_client_get_queue_stats(DropboxCommandClient *dcc,
+                                            guint *depth, guint *peak,
+                                            guint *shed) {
+  g_async_queue_lock(dcc->command_queue);
+  if (depth != NULL) *depth = queue_depth(dcc);
+  if (peak != NULL) *peak = dcc->queue_peak;
+  if (shed != NULL) *shed = dcc->requests_shed;
+  g_async_queue_unlock(dcc->command_queue);
+}
@@ -0,0 +1,76 @@
+/*
+ * dropbox-command-queue.h
+ * Header file for dropbox-command-queue.c
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DROPBOX_COMMAND_QUEUE_H
+#define DROPBOX_COMMAND_QUEUE_H
+
+#include <glib.h>
+
+#include "dropbox-command-client.h"
+
+G_BEGIN_DECLS
+
+/* the bounded command_queue both command clients take their requests
+   from, and the timing of the requests on their way through the client */
+
+void dropbox_command_queue_init(DropboxCommandClient *dcc);
+
+DropboxCommand *dropbox_command_queue_push(DropboxCommandClient *dcc,
+                                           DropboxCommand *dc);
+
+void dropbox_command_queue_push_marker(DropboxCommandClient *dcc,
+                                       DropboxCommand *dc);
+
+DropboxCommand *dropbox_command_queue_pop(DropboxCommandClient *dcc,
+                                          guint64 timeout);
+
+/* the name the request's stats are kept under */
+const gchar *dropbox_command_stats_name(DropboxCommand *dc);
+
+/* the first path the request is about, if any */
+const gchar *dropbox_command_path(DropboxCommand *dc);
+
+/* the request left the queue and goes to the daemon now */
+void dropbox_command_started(DropboxCommand *dc);
+
+typedef enum {
+  /* a command of the request is about to be written */
+  DROPBOX_MARK_SEND,
+  /* all of it went out */
+  DROPBOX_MARK_WRITTEN,
+  /* the first byte of its reply came in */
+  DROPBOX_MARK_REPLY,
+  /* the whole reply is in */
+  DROPBOX_MARK_DONE
+} DropboxCommandMark;
+
+/* for sampled requests only, dc may be NULL */
+void dropbox_command_mark(DropboxCommand *dc, DropboxCommandMark mark);
+
+/* the daemon is done with the request, successfully or not */
+void dropbox_command_replied(DropboxCommand *dc);
+
+/* on the main loop, right before the request's handler runs */
+void dropbox_command_finished(DropboxCommand *dc);
+
+G_END_DECLS
+
+#endif
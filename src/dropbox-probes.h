@@ -0,0 +1,64 @@
+/*
+ * dropbox-probes.h
+ * Static tracepoints on the way of a request through the client.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DROPBOX_PROBES_H
+#define DROPBOX_PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*
+  With --enable-sdt-probes these are sys/sdt.h probes of the provider
+  caja_dropbox, a nop instruction each until perf, bpftrace or systemtap
+  attach to them.  Otherwise they compile to nothing and their arguments
+  aren't even evaluated.
+
+  Every probe has the same three arguments: a name, a path (either may be
+  NULL) and the request id, 0 if there is no request.
+
+    request__enqueue   request name, path, id   queued for the daemon
+    request__shed      request name, path, id   dropped from a full queue
+    request__dequeue   request name, path, id   taken off the queue
+    request__cancel    request name, path, id   caja lost interest
+    request__done      request name, path, id   its handler is about to run
+    command__send      command name, path, id   one command to the daemon
+    command__reply     command name, path, id   its whole reply is in
+    connect            "command" or "hooks", socket path, 0
+    disconnect         "command" or "hooks", socket path, 0
+    hook__dispatch     hook name, path, 0       its hooks are about to run
+
+  e.g. bpftrace -e 'usdt:libdropbox-client.so:caja_dropbox:request__done
+                    { printf("%s %s\n", str(arg0), str(arg1)); }'
+*/
+
+#ifdef HAVE_SDT_PROBES
+#include <sys/sdt.h>
+
+#define DROPBOX_PROBE(probe, name, path, id) \
+  DTRACE_PROBE3(caja_dropbox, probe, name, path, id)
+#else
+#define DROPBOX_PROBE(probe, name, path, id) \
+  do {                                       \
+  } while (0)
+#endif
+
+#endif
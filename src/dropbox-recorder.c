@@ -0,0 +1,226 @@
+/*
+ * dropbox-recorder.c
+ * Records the traffic on the Dropbox sockets for dropbox-replay.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dropbox-recorder.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dropbox-client-util.h"
+
+#define TRACE_MAGIC "CDRT"
+/* bigger strings are garbage */
+#define TRACE_STR_MAX (16 * 1024 * 1024)
+
+static GMutex recorder_mutex;
+/* NULL while off, written under recorder_mutex */
+static FILE *trace;
+static gint64 start_time;
+static guint32 last_sequence;
+
+static void put_u32(GString *out, guint32 n) {
+  n = GUINT32_TO_BE(n);
+  g_string_append_len(out, (const gchar *)&n, 4);
+}
+
+static void put_str(GString *out, const gchar *s, gsize len) {
+  put_u32(out, len);
+  g_string_append_len(out, s, len);
+}
+
+void dropbox_recorder_init(void) {
+  static gsize initialized = 0;
+
+  if (g_once_init_enter(&initialized)) {
+    const gchar *filename = g_getenv("CAJA_DROPBOX_RECORD");
+
+    if (filename != NULL && filename[0]) {
+      FILE *f = fopen(filename, "wb");
+
+      if (f != NULL) {
+        GString *header = g_string_new(TRACE_MAGIC);
+
+        put_u32(header, DROPBOX_TRACE_VERSION);
+        fwrite(header->str, 1, header->len, f);
+        fflush(f);
+        g_string_free(header, TRUE);
+
+        start_time = g_get_monotonic_time();
+        trace = f;
+        g_debug("recording the sockets to %s", filename);
+      } else {
+        g_warning("couldn't record to %s: %s", filename, g_strerror(errno));
+      }
+    }
+
+    g_once_init_leave(&initialized, 1);
+  }
+}
+
+gboolean dropbox_recorder_enabled(void) { return trace != NULL; }
+
+/* flushed right away, the interesting traces end with caja being killed */
+static void write_record(gchar kind, guint32 sequence,
+                         const gchar *socket_path, GString *message) {
+  GString *out = g_string_sized_new(message->len + 64);
+  gint64 time;
+
+  g_mutex_lock(&recorder_mutex);
+  time = GINT64_TO_BE(g_get_monotonic_time() - start_time);
+  g_string_append_len(out, (const gchar *)&time, 8);
+  g_string_append_c(out, kind);
+  put_u32(out, sequence);
+  put_str(out, socket_path, strlen(socket_path));
+  put_str(out, message->str, message->len);
+  fwrite(out->str, 1, out->len, trace);
+  fflush(trace);
+  g_mutex_unlock(&recorder_mutex);
+
+  g_string_free(out, TRUE);
+}
+
+guint32 dropbox_recorder_command(const gchar *socket_path,
+                                 const gchar *command_name, GHashTable *args) {
+  GString *message;
+  guint32 sequence;
+
+  if (trace == NULL) {
+    return 0;
+  }
+
+  message = g_string_new(NULL);
+  dropbox_client_util_append_command(message, command_name, args);
+  sequence = (guint32)g_atomic_int_add((gint *)&last_sequence, 1) + 1;
+  write_record(DROPBOX_TRACE_COMMAND, sequence, socket_path, message);
+  g_string_free(message, TRUE);
+
+  return sequence;
+}
+
+void dropbox_recorder_reply(const gchar *socket_path, guint32 sequence,
+                            GHashTable *reply) {
+  GString *message;
+
+  if (trace == NULL) {
+    return;
+  }
+
+  /* the status line is written like a command name */
+  message = g_string_new(NULL);
+  dropbox_client_util_append_command(message, reply != NULL ? "ok" : "notok",
+                                     reply);
+  write_record(DROPBOX_TRACE_REPLY, sequence, socket_path, message);
+  g_string_free(message, TRUE);
+}
+
+void dropbox_recorder_hook(const gchar *socket_path, const gchar *raw) {
+  GString *message;
+
+  if (trace == NULL) {
+    return;
+  }
+
+  message = g_string_new(raw);
+  g_string_append(message, "\ndone\n");
+  write_record(DROPBOX_TRACE_HOOK, 0, socket_path, message);
+  g_string_free(message, TRUE);
+}
+
+static void trace_record_free(DropboxTraceRecord *record) {
+  g_free(record->socket_path);
+  g_free(record->message);
+  g_free(record);
+}
+
+static gboolean get_u32(const gchar **p, const gchar *end, guint32 *n) {
+  if (end - *p < 4) {
+    return FALSE;
+  }
+  memcpy(n, *p, 4);
+  *n = GUINT32_FROM_BE(*n);
+  *p += 4;
+  return TRUE;
+}
+
+static gchar *get_str(const gchar **p, const gchar *end) {
+  guint32 len;
+  gchar *s;
+
+  if (!get_u32(p, end, &len) || len > TRACE_STR_MAX || end - *p < len) {
+    return NULL;
+  }
+  s = g_strndup(*p, len);
+  *p += len;
+  return s;
+}
+
+GPtrArray *dropbox_trace_load(const gchar *filename, GError **error) {
+  GPtrArray *records;
+  const gchar *p, *end;
+  gchar *contents;
+  gsize length;
+  guint32 version;
+
+  if (!g_file_get_contents(filename, &contents, &length, error)) {
+    return NULL;
+  }
+
+  p = contents;
+  end = contents + length;
+  if (length < 4 || memcmp(p, TRACE_MAGIC, 4) != 0 ||
+      (p += 4, !get_u32(&p, end, &version)) ||
+      version != DROPBOX_TRACE_VERSION) {
+    g_set_error(error, g_quark_from_static_string("parse error"), 0,
+                "%s is not a caja-dropbox trace", filename);
+    g_free(contents);
+    return NULL;
+  }
+
+  records = g_ptr_array_new_with_free_func((GDestroyNotify)trace_record_free);
+  while (p < end) {
+    DropboxTraceRecord *record = g_new0(DropboxTraceRecord, 1);
+
+    g_ptr_array_add(records, record);
+    if (end - p < 9) {
+      break;
+    }
+    memcpy(&record->time, p, 8);
+    record->time = GINT64_FROM_BE(record->time);
+    record->kind = p[8];
+    p += 9;
+    if (!get_u32(&p, end, &record->sequence) ||
+        (record->socket_path = get_str(&p, end)) == NULL ||
+        (record->message = get_str(&p, end)) == NULL) {
+      break;
+    }
+  }
+
+  /* a trace cut off in the middle of a record, caja died writing it */
+  if (records->len > 0 &&
+      ((DropboxTraceRecord *)g_ptr_array_index(records, records->len - 1))
+              ->message == NULL) {
+    g_ptr_array_set_size(records, records->len - 1);
+  }
+
+  g_free(contents);
+  return records;
+}
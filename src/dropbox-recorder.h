@@ -0,0 +1,79 @@
+/*
+ * dropbox-recorder.h
+ * Header file for dropbox-recorder.c
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DROPBOX_RECORDER_H
+#define DROPBOX_RECORDER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* a trace of everything said on the sockets, for dropbox-replay.
+
+   with CAJA_DROPBOX_RECORD set to a file name, every command and its reply
+   on command_socket and every message on iface_socket go to that file, all
+   thread safe.  the file is
+
+     "CDRT", u32 version (DROPBOX_TRACE_VERSION), then records of
+     i64 microseconds since the recording started
+     u8  kind, DROPBOX_TRACE_COMMAND, _REPLY or _HOOK
+     u32 sequence number, a reply carries the one of its command, 0 for hooks
+     str path of the socket
+     str the message in the text protocol, "done" included
+
+   numbers are big endian and a str is a u32 length and that many bytes.
+   replies are "ok" or "notok" and the args.  a command that got no reply
+   because the connection broke has no reply record. */
+#define DROPBOX_TRACE_VERSION 1
+#define DROPBOX_TRACE_COMMAND 'C'
+#define DROPBOX_TRACE_REPLY 'R'
+#define DROPBOX_TRACE_HOOK 'H'
+
+typedef struct {
+  gint64 time;
+  gchar kind;
+  guint32 sequence;
+  gchar *socket_path;
+  gchar *message;
+} DropboxTraceRecord;
+
+/* reads CAJA_DROPBOX_RECORD, safe to call more than once */
+void dropbox_recorder_init(void);
+
+gboolean dropbox_recorder_enabled(void);
+
+/* returns the sequence number for the reply */
+guint32 dropbox_recorder_command(const gchar *socket_path,
+                                 const gchar *command_name, GHashTable *args);
+
+/* reply is NULL if the daemon didn't say "ok" */
+void dropbox_recorder_reply(const gchar *socket_path, guint32 sequence,
+                            GHashTable *reply);
+
+/* raw is the message as read, without "done" */
+void dropbox_recorder_hook(const gchar *socket_path, const gchar *raw);
+
+/* the records of a trace file, in order */
+GPtrArray *dropbox_trace_load(const gchar *filename, GError **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,581 @@
+/*
+ * dropbox-replay.c
+ * Stands in for the Dropbox daemon, answering from a recorded trace.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  dropbox-replay [OPTION...] TRACE
+
+  Listens on command_socket and iface_socket like the daemon did when
+  TRACE was recorded with CAJA_DROPBOX_RECORD.  Every command gets the
+  reply the daemon gave to the same command, after the time it took back
+  then, and the hook messages go out at the times they were read.  Commands
+  are matched by name and args, not by their position, so a build that asks
+  in a different order or less often still gets sensible answers; a command
+  that never came up is answered "notok".
+
+  On exit it prints what it served, how long the client took, and how long
+  the client spent between getting a reply and sending its next command on
+  the same connection, which is the client's own share of the time.
+*/
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dropbox-client-util.h"
+#include "dropbox-recorder.h"
+
+typedef struct {
+  /* in the text protocol, "done" included */
+  gchar *message;
+  /* how long the daemon took, in microseconds */
+  gint64 think;
+} RecordedReply;
+
+typedef struct {
+  GOutputStream *out;
+  gboolean binary_framing;
+  gint64 last_reply;
+} Connection;
+
+static gchar *socket_dir;
+static gchar *instance;
+static gdouble speed = 1.0;
+static gboolean exit_when_done;
+
+static GMainLoop *main_loop;
+
+/* loaded before the sockets are up, command key to a GQueue of
+   RecordedReply */
+static GHashTable *replies;
+/* the DropboxTraceRecord of the hooks, in order, and all of them */
+static GPtrArray *hooks;
+static GPtrArray *records;
+static gint64 trace_start = G_MAXINT64;
+static guint recorded_commands;
+
+static GMutex replay_mutex;
+/* the rest is under replay_mutex */
+static gint64 replay_start;
+static gint64 first_command;
+static gint64 last_reply;
+static guint served;
+static guint unmatched;
+static guint hooks_sent;
+/* of gint64, microseconds from a reply to the next command */
+static GArray *gaps;
+static gboolean hooks_taken;
+
+static GOptionEntry entries[] = {
+    {"dir", 'd', 0, G_OPTION_ARG_FILENAME, &socket_dir,
+     "Where to put the sockets (default ~/.dropbox)", "DIR"},
+    {"instance", 'i', 0, G_OPTION_ARG_FILENAME, &instance,
+     "Which recorded daemon to play (default the first in the trace)", "DIR"},
+    {"speed", 's', 0, G_OPTION_ARG_DOUBLE, &speed,
+     "Divide the recorded delays by this, 0 for no delays (default 1)", "F"},
+    {"exit", 'x', 0, G_OPTION_ARG_NONE, &exit_when_done,
+     "Exit once every recorded command and hook has been played", NULL},
+    {NULL}};
+
+/* hash tables don't keep an order, so neither do the args in the key */
+static gint compare_lines(gconstpointer a, gconstpointer b) {
+  return strcmp(*(gchar *const *)a, *(gchar *const *)b);
+}
+
+static gchar *command_key(const gchar *message) {
+  gchar **lines = g_strsplit(message, "\n", -1);
+  guint n = g_strv_length(lines);
+  gchar *key;
+
+  /* the name, the args, "done" and what follows the last newline */
+  if (n > 3) {
+    qsort(lines + 1, n - 3, sizeof(gchar *), compare_lines);
+  }
+  key = g_strjoinv("\n", lines);
+  g_strfreev(lines);
+  return key;
+}
+
+static gint64 scaled(gint64 usec) {
+  return speed > 0 ? (gint64)(usec / speed) : 0;
+}
+
+static void recorded_reply_free(RecordedReply *reply) {
+  g_free(reply->message);
+  g_free(reply);
+}
+
+static void reply_queue_free(GQueue *queue) {
+  g_queue_free_full(queue, (GDestroyNotify)recorded_reply_free);
+}
+
+static gboolean load_trace(const gchar *filename, GError **error) {
+  /* sequence to the command record */
+  GHashTable *commands;
+  guint i;
+
+  if ((records = dropbox_trace_load(filename, error)) == NULL) {
+    return FALSE;
+  }
+
+  replies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify)reply_queue_free);
+  hooks = g_ptr_array_new();
+  commands = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  for (i = 0; i < records->len; i++) {
+    DropboxTraceRecord *record = g_ptr_array_index(records, i);
+    gchar *dir = g_path_get_dirname(record->socket_path);
+    gboolean ours;
+
+    if (instance == NULL) {
+      instance = g_strdup(dir);
+    }
+    ours = strcmp(dir, instance) == 0;
+    g_free(dir);
+    if (!ours) {
+      continue;
+    }
+
+    trace_start = MIN(trace_start, record->time);
+
+    switch (record->kind) {
+      case DROPBOX_TRACE_COMMAND:
+        g_hash_table_insert(commands, GUINT_TO_POINTER(record->sequence),
+                            record);
+        break;
+      case DROPBOX_TRACE_REPLY: {
+        DropboxTraceRecord *command = g_hash_table_lookup(
+            commands, GUINT_TO_POINTER(record->sequence));
+        RecordedReply *reply;
+        GQueue *queue;
+        gchar *key;
+
+        if (command == NULL) {
+          break;
+        }
+        reply = g_new(RecordedReply, 1);
+        reply->message = g_strdup(record->message);
+        reply->think = record->time - command->time;
+
+        key = command_key(command->message);
+        if ((queue = g_hash_table_lookup(replies, key)) == NULL) {
+          queue = g_queue_new();
+          g_hash_table_insert(replies, key, queue);
+        } else {
+          g_free(key);
+        }
+        g_queue_push_tail(queue, reply);
+        recorded_commands++;
+        break;
+      }
+      case DROPBOX_TRACE_HOOK:
+        g_ptr_array_add(hooks, record);
+        break;
+    }
+  }
+
+  g_hash_table_destroy(commands);
+
+  g_print("%s: %u commands and %u hooks of %s\n", filename, recorded_commands,
+          hooks->len, instance);
+  return TRUE;
+}
+
+static void check_done(void) {
+  if (exit_when_done && served >= recorded_commands &&
+      hooks_sent >= hooks->len) {
+    g_main_loop_quit(main_loop);
+  }
+}
+
+static void start_clock(void) {
+  g_mutex_lock(&replay_mutex);
+  if (replay_start == 0) {
+    replay_start = g_get_monotonic_time();
+  }
+  g_mutex_unlock(&replay_mutex);
+}
+
+/* the recorded reply as a frame for request_id */
+static void append_reply_frame(GString *out, const gchar *message,
+                               guint32 request_id) {
+  gchar **lines = g_strsplit(message, "\n", -1);
+  GHashTable *args;
+  int i;
+
+  args =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+  for (i = 1; lines[i] != NULL && strcmp(lines[i], "done") != 0; i++) {
+    dropbox_client_util_command_parse_arg(lines[i], args);
+  }
+
+  dropbox_client_util_append_frame(
+      out, request_id,
+      strcmp(lines[0], "ok") == 0 ? DROPBOX_FRAME_OK : DROPBOX_FRAME_ERROR,
+      NULL, args);
+
+  g_hash_table_destroy(args);
+  g_strfreev(lines);
+}
+
+/* answers one command, FALSE if the client went away */
+static gboolean answer(Connection *conn, const gchar *message,
+                       guint32 request_id) {
+  gchar *key = command_key(message);
+  gchar *reply_message;
+  gint64 think = 0, now = g_get_monotonic_time();
+  gboolean switch_framing = FALSE;
+  GString *out;
+  GQueue *queue;
+  gboolean ok;
+
+  g_mutex_lock(&replay_mutex);
+  if (first_command == 0) {
+    first_command = now;
+  }
+  if (conn->last_reply != 0) {
+    gint64 gap = now - conn->last_reply;
+
+    g_array_append_val(gaps, gap);
+  }
+
+  /* the last reply to a command keeps answering it */
+  if ((queue = g_hash_table_lookup(replies, key)) != NULL) {
+    RecordedReply *reply = g_queue_peek_head(queue);
+
+    reply_message = g_strdup(reply->message);
+    think = reply->think;
+    if (g_queue_get_length(queue) > 1) {
+      recorded_reply_free(g_queue_pop_head(queue));
+    }
+  } else {
+    reply_message = g_strdup("notok\ndone\n");
+    unmatched++;
+  }
+  g_mutex_unlock(&replay_mutex);
+
+  /* the daemon switches right after its reply if it took binary frames */
+  if (g_str_has_prefix(message, DROPBOX_FRAMING_COMMAND "\n") &&
+      g_str_has_prefix(reply_message, "ok\n") &&
+      strstr(reply_message, "\nframing\t" DROPBOX_FRAMING_BINARY "\n") !=
+          NULL) {
+    switch_framing = TRUE;
+  }
+
+  if (scaled(think) > 0) {
+    g_usleep(scaled(think));
+  }
+
+  out = g_string_new(NULL);
+  if (conn->binary_framing) {
+    append_reply_frame(out, reply_message, request_id);
+  } else {
+    g_string_append(out, reply_message);
+  }
+  ok = g_output_stream_write_all(conn->out, out->str, out->len, NULL, NULL,
+                                 NULL);
+  g_string_free(out, TRUE);
+  g_free(reply_message);
+  g_free(key);
+
+  conn->binary_framing = conn->binary_framing || switch_framing;
+  conn->last_reply = g_get_monotonic_time();
+
+  g_mutex_lock(&replay_mutex);
+  last_reply = conn->last_reply;
+  served++;
+  check_done();
+  g_mutex_unlock(&replay_mutex);
+
+  return ok;
+}
+
+/* GThreadedSocketService runs this in a thread of its own per client */
+static gboolean serve_commands(GThreadedSocketService *service,
+                               GSocketConnection *connection,
+                               GObject *source_object, gpointer user_data) {
+  GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+  GString *buf = g_string_new(NULL), *message = NULL;
+  Connection conn = {NULL, FALSE, 0};
+  gboolean ok = TRUE;
+  gssize n;
+
+  conn.out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+  start_clock();
+
+  while (ok) {
+    gchar chunk[16384];
+    gsize pos = 0;
+
+    if ((n = g_input_stream_read(in, chunk, sizeof(chunk), NULL, NULL)) <= 0) {
+      break;
+    }
+    g_string_append_len(buf, chunk, n);
+
+    while (ok) {
+      if (conn.binary_framing) {
+        DropboxFrameStatus status;
+        GHashTable *args = NULL;
+        guint32 request_id;
+        gchar kind = 0, *name = NULL;
+
+        status = dropbox_client_util_next_frame(buf, &pos, &request_id, &kind,
+                                                &name, &args);
+        if (status == DROPBOX_FRAME_INCOMPLETE) {
+          break;
+        } else if (status == DROPBOX_FRAME_BAD ||
+                   kind != DROPBOX_FRAME_COMMAND) {
+          if (status == DROPBOX_FRAME_PARSED) {
+            g_free(name);
+            g_hash_table_destroy(args);
+          }
+          ok = FALSE;
+          break;
+        }
+
+        message = g_string_new(NULL);
+        dropbox_client_util_append_command(message, name, args);
+        ok = answer(&conn, message->str, request_id);
+        g_string_free(message, TRUE);
+        message = NULL;
+        g_free(name);
+        g_hash_table_destroy(args);
+      } else {
+        gchar *line = dropbox_client_util_next_line(buf, &pos);
+
+        if (line == NULL) {
+          break;
+        }
+        if (message == NULL) {
+          message = g_string_new(NULL);
+        }
+        g_string_append(message, line);
+        g_string_append_c(message, '\n');
+        if (strcmp(line, "done") == 0) {
+          ok = answer(&conn, message->str, 0);
+          g_string_free(message, TRUE);
+          message = NULL;
+        }
+        g_free(line);
+      }
+    }
+    g_string_erase(buf, 0, pos);
+  }
+
+  if (message != NULL) {
+    g_string_free(message, TRUE);
+  }
+  g_string_free(buf, TRUE);
+  return TRUE;
+}
+
+static gboolean serve_hooks(GThreadedSocketService *service,
+                            GSocketConnection *connection,
+                            GObject *source_object, gpointer user_data) {
+  GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+  GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+  gboolean ours;
+  gchar chunk[256];
+  guint i;
+
+  start_clock();
+
+  /* the hooks go out once, to the first client */
+  g_mutex_lock(&replay_mutex);
+  ours = !hooks_taken;
+  hooks_taken = TRUE;
+  g_mutex_unlock(&replay_mutex);
+
+  for (i = 0; ours && i < hooks->len; i++) {
+    DropboxTraceRecord *record = g_ptr_array_index(hooks, i);
+    gint64 wait =
+        replay_start + scaled(record->time - trace_start) -
+        g_get_monotonic_time();
+
+    if (wait > 0) {
+      g_usleep(wait);
+    }
+    if (!g_output_stream_write_all(out, record->message,
+                                   strlen(record->message), NULL, NULL,
+                                   NULL)) {
+      break;
+    }
+
+    g_mutex_lock(&replay_mutex);
+    hooks_sent++;
+    check_done();
+    g_mutex_unlock(&replay_mutex);
+  }
+
+  /* hang on to it, a client that sees us hang up comes back for more */
+  while (g_input_stream_read(in, chunk, sizeof(chunk), NULL, NULL) > 0) {
+  }
+
+  return TRUE;
+}
+
+/* a daemon still answers on it, don't take it away */
+static gboolean socket_in_use(const struct sockaddr_un *addr) {
+  int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+  gboolean in_use;
+
+  if (sock < 0) {
+    return FALSE;
+  }
+  in_use = connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+  close(sock);
+  return in_use;
+}
+
+static GSocketService *listen_on(const gchar *name, GCallback serve,
+                                 GError **error) {
+  struct sockaddr_un addr;
+  GSocketAddress *address;
+  GSocketService *service;
+  gchar *path;
+
+  path = g_build_filename(socket_dir, name, NULL);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+  if (socket_in_use(&addr)) {
+    g_set_error(error, g_quark_from_static_string("socket in use"), 0,
+                "%s is in use, is Dropbox running?", path);
+    g_free(path);
+    return NULL;
+  }
+  unlink(path);
+  g_free(path);
+
+  service = g_threaded_socket_service_new(-1);
+  address = g_socket_address_new_from_native(&addr, sizeof(addr));
+  if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+                                     G_SOCKET_TYPE_STREAM,
+                                     G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+                                     error)) {
+    g_object_unref(address);
+    g_object_unref(service);
+    return NULL;
+  }
+  g_object_unref(address);
+
+  g_signal_connect(service, "run", serve, NULL);
+  g_socket_service_start(service);
+  return service;
+}
+
+static gint compare_gaps(gconstpointer a, gconstpointer b) {
+  gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void print_report(void) {
+  gint64 total = 0, elapsed;
+  guint i;
+
+  g_mutex_lock(&replay_mutex);
+  elapsed = last_reply - first_command;
+  g_print("commands: %u answered, %u not in the trace, %u recorded\n", served,
+          unmatched, recorded_commands);
+  g_print("hooks: %u of %u sent\n", hooks_sent, hooks->len);
+  if (served > 0 && elapsed > 0) {
+    g_print("elapsed: %.1f ms, %.0f commands/s\n", elapsed / 1000.0,
+            served * (gdouble)G_USEC_PER_SEC / elapsed);
+  }
+
+  if (gaps->len > 0) {
+    g_array_sort(gaps, compare_gaps);
+    for (i = 0; i < gaps->len; i++) {
+      total += g_array_index(gaps, gint64, i);
+    }
+    g_print("client time between commands: mean %.0f us, median %"
+            G_GINT64_FORMAT " us, p99 %" G_GINT64_FORMAT " us, max %"
+            G_GINT64_FORMAT " us\n",
+            total / (gdouble)gaps->len,
+            g_array_index(gaps, gint64, gaps->len / 2),
+            g_array_index(gaps, gint64, gaps->len * 99 / 100),
+            g_array_index(gaps, gint64, gaps->len - 1));
+  }
+  g_mutex_unlock(&replay_mutex);
+}
+
+static gboolean quit(gpointer data) {
+  g_main_loop_quit(main_loop);
+  return TRUE;
+}
+
+int main(int argc, char **argv) {
+  GOptionContext *context;
+  GSocketService *commands, *iface;
+  GError *error = NULL;
+
+  context = g_option_context_new("TRACE - play a recorded Dropbox daemon");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error) || argc != 2) {
+    g_printerr("%s\n", error != NULL ? error->message
+                                     : "Give it the trace to play.");
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (socket_dir == NULL) {
+    socket_dir = g_build_filename(g_get_home_dir(), ".dropbox", NULL);
+  }
+  g_mkdir_with_parents(socket_dir, 0700);
+
+  if (!load_trace(argv[1], &error)) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+  gaps = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+  /* a client hanging up in the middle of a write */
+  signal(SIGPIPE, SIG_IGN);
+
+  main_loop = g_main_loop_new(NULL, FALSE);
+  if ((commands = listen_on("command_socket", G_CALLBACK(serve_commands),
+                            &error)) == NULL ||
+      (iface = listen_on("iface_socket", G_CALLBACK(serve_hooks), &error)) ==
+          NULL) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+  g_unix_signal_add(SIGINT, quit, NULL);
+  g_unix_signal_add(SIGTERM, quit, NULL);
+
+  g_print("listening in %s\n", socket_dir);
+  g_main_loop_run(main_loop);
+
+  g_socket_service_stop(commands);
+  g_socket_service_stop(iface);
+  print_report();
+  return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * dropbox-stats.c
+ * Counters and latency histograms of the command and hook clients.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <unistd.h>
+
+#include "dropbox-stats.h"
+
+/* bucket i counts latencies below 2^i microseconds that didn't fit in
+   bucket i - 1, the last one takes everything from about 18 minutes up */
+#define BUCKETS 31
+
+typedef struct {
+  guint64 count;
+  guint64 sum;
+  guint64 max;
+  guint64 buckets[BUCKETS];
+} Histogram;
+
+typedef struct {
+  Histogram stages[DROPBOX_STATS_N_STAGES];
+} NameStats;
+
+typedef struct {
+  gint64 value;
+  gint64 peak;
+} Counter;
+
+static const gchar *stage_names[DROPBOX_STATS_N_STAGES] = {
+    "queue", "socket", "delivery", "run", "main_loop"};
+
+static GMutex stats_mutex;
+/* names to NameStats and Counter, both live as long as the process */
+static GHashTable *names;
+static GHashTable *counters;
+static gint64 start_time;
+
+static void init_stats(void) {
+  if (names == NULL) {
+    names = g_hash_table_new(g_str_hash, g_str_equal);
+    counters = g_hash_table_new(g_str_hash, g_str_equal);
+    start_time = g_get_monotonic_time();
+  }
+}
+
+void dropbox_stats_record(const gchar *name, DropboxStatsStage stage,
+                          gint64 usec) {
+  NameStats *ns;
+  Histogram *h;
+  guint bucket;
+
+  usec = MAX(usec, 0);
+  bucket = usec > 0 ? MIN(g_bit_storage(usec), BUCKETS - 1) : 0;
+
+  g_mutex_lock(&stats_mutex);
+  init_stats();
+
+  if ((ns = g_hash_table_lookup(names, name)) == NULL) {
+    ns = g_new0(NameStats, 1);
+    g_hash_table_insert(names, g_strdup(name), ns);
+  }
+
+  h = &(ns->stages[stage]);
+  h->count++;
+  h->sum += usec;
+  h->max = MAX(h->max, (guint64)usec);
+  h->buckets[bucket]++;
+
+  g_mutex_unlock(&stats_mutex);
+}
+
+void dropbox_stats_record_since(const gchar *name, DropboxStatsStage stage,
+                                gint64 since) {
+  dropbox_stats_record(name, stage, g_get_monotonic_time() - since);
+}
+
+void dropbox_stats_add(const gchar *counter, gint64 delta) {
+  Counter *c;
+
+  g_mutex_lock(&stats_mutex);
+  init_stats();
+
+  if ((c = g_hash_table_lookup(counters, counter)) == NULL) {
+    c = g_new0(Counter, 1);
+    g_hash_table_insert(counters, g_strdup(counter), c);
+  }
+
+  c->value += delta;
+  c->peak = MAX(c->peak, c->value);
+
+  g_mutex_unlock(&stats_mutex);
+}
+
+static void append_json_string(GString *out, const gchar *s) {
+  g_string_append_c(out, '"');
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      g_string_append_c(out, '\\');
+      g_string_append_c(out, *s);
+    } else if ((guchar)*s < 0x20) {
+      g_string_append_printf(out, "\\u%04x", (guchar)*s);
+    } else {
+      g_string_append_c(out, *s);
+    }
+  }
+  g_string_append_c(out, '"');
+}
+
+static void append_histogram(GString *out, const Histogram *h) {
+  const gchar *sep = "";
+  guint i;
+
+  g_string_append_printf(out,
+                         "{\"count\": %" G_GUINT64_FORMAT
+                         ", \"sum_us\": %" G_GUINT64_FORMAT
+                         ", \"max_us\": %" G_GUINT64_FORMAT ", \"buckets\": [",
+                         h->count, h->sum, h->max);
+
+  /* [upper bound in us, count], only the buckets that have something */
+  for (i = 0; i < BUCKETS; i++) {
+    if (h->buckets[i] > 0) {
+      g_string_append_printf(out, "%s[%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT
+                             "]",
+                             sep, (guint64)1 << i, h->buckets[i]);
+      sep = ", ";
+    }
+  }
+
+  g_string_append(out, "]}");
+}
+
+static gint compare_keys(gconstpointer a, gconstpointer b) {
+  return g_strcmp0(*(const gchar **)a, *(const gchar **)b);
+}
+
+/* the table's keys, sorted so dumps are easy to diff */
+static GPtrArray *sorted_keys(GHashTable *table) {
+  GPtrArray *keys = g_ptr_array_new();
+  GHashTableIter iter;
+  gpointer key;
+
+  g_hash_table_iter_init(&iter, table);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    g_ptr_array_add(keys, key);
+  }
+  g_ptr_array_sort(keys, compare_keys);
+
+  return keys;
+}
+
+gchar *dropbox_stats_to_json(void) {
+  GString *out = g_string_new(NULL);
+  GPtrArray *keys;
+  guint i, stage;
+
+  g_mutex_lock(&stats_mutex);
+  init_stats();
+
+  g_string_append_printf(out,
+                         "{\"pid\": %d, \"time\": %" G_GINT64_FORMAT
+                         ", \"uptime_us\": %" G_GINT64_FORMAT ",\n",
+                         (int)getpid(), g_get_real_time() / G_USEC_PER_SEC,
+                         g_get_monotonic_time() - start_time);
+
+  g_string_append(out, " \"counters\": {");
+  keys = sorted_keys(counters);
+  for (i = 0; i < keys->len; i++) {
+    Counter *c = g_hash_table_lookup(counters, keys->pdata[i]);
+
+    g_string_append(out, i > 0 ? ",\n  " : "\n  ");
+    append_json_string(out, keys->pdata[i]);
+    g_string_append_printf(out,
+                           ": {\"value\": %" G_GINT64_FORMAT
+                           ", \"peak\": %" G_GINT64_FORMAT "}",
+                           c->value, c->peak);
+  }
+  g_ptr_array_free(keys, TRUE);
+
+  g_string_append(out, "},\n \"latencies\": {");
+  keys = sorted_keys(names);
+  for (i = 0; i < keys->len; i++) {
+    NameStats *ns = g_hash_table_lookup(names, keys->pdata[i]);
+    const gchar *sep = "";
+
+    g_string_append(out, i > 0 ? ",\n  " : "\n  ");
+    append_json_string(out, keys->pdata[i]);
+    g_string_append(out, ": {");
+    for (stage = 0; stage < DROPBOX_STATS_N_STAGES; stage++) {
+      if (ns->stages[stage].count > 0) {
+        g_string_append_printf(out, "%s\n   \"%s\": ", sep, stage_names[stage]);
+        append_histogram(out, &(ns->stages[stage]));
+        sep = ",";
+      }
+    }
+    g_string_append(out, "}");
+  }
+  g_ptr_array_free(keys, TRUE);
+
+  g_mutex_unlock(&stats_mutex);
+
+  g_string_append(out, "}}\n");
+  return g_string_free(out, FALSE);
+}
+
+gchar *dropbox_stats_dump(GError **error) {
+  gchar *json, *basename, *filename;
+
+  json = dropbox_stats_to_json();
+  basename = g_strdup_printf("caja-dropbox-stats-%d.json", (int)getpid());
+  filename = g_build_filename(g_get_user_runtime_dir(), basename, NULL);
+  g_free(basename);
+
+  if (!g_file_set_contents(filename, json, -1, error)) {
+    g_free(filename);
+    filename = NULL;
+  }
+
+  g_free(json);
+  return filename;
+}
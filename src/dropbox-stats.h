@@ -0,0 +1,65 @@
+/*
+ * dropbox-stats.h
+ * Header file for dropbox-stats.c
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DROPBOX_STATS_H
+#define DROPBOX_STATS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* process wide counters and latency histograms, all thread safe.
+
+   latencies are kept per command (or hook) name and stage, in buckets of
+   powers of two microseconds.  counters go up and down, their peak is
+   kept too, so they work for gauges like the queue depth. */
+
+typedef enum {
+  /* waiting in command_queue, or for the main loop to pick up a hook */
+  DROPBOX_STATS_QUEUE,
+  /* from writing the command to having its whole reply */
+  DROPBOX_STATS_SOCKET,
+  /* from the reply to the handler running on the main loop */
+  DROPBOX_STATS_DELIVERY,
+  /* running the hooks */
+  DROPBOX_STATS_RUN,
+  /* holding the main loop, see dropbox-watchdog.h */
+  DROPBOX_STATS_MAIN_LOOP,
+  DROPBOX_STATS_N_STAGES
+} DropboxStatsStage;
+
+void dropbox_stats_record(const gchar *name, DropboxStatsStage stage,
+                          gint64 usec);
+
+void dropbox_stats_record_since(const gchar *name, DropboxStatsStage stage,
+                                gint64 since);
+
+void dropbox_stats_add(const gchar *counter, gint64 delta);
+
+gchar *dropbox_stats_to_json(void);
+
+/* writes dropbox_stats_to_json() to caja-dropbox-stats-<pid>.json in
+   $XDG_RUNTIME_DIR, returns the file name */
+gchar *dropbox_stats_dump(GError **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,281 @@
+/*
+ * dropbox-watchdog.c
+ * Measures how long caja-dropbox holds the main loop.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "dropbox-watchdog.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+#include "dropbox-stats.h"
+
+/*
+  The watcher thread sleeps until an entry starts and then until it has
+  run for the threshold.  If the main thread is still in the same entry by
+  then it gets SAMPLE_SIGNAL, the handler records its stack with
+  backtrace() and the watcher logs it while the main loop is still stuck,
+  so the stack shows where the time goes, not where the entry returned.
+  The entry logs its total once it returns.
+
+  SIGURG is ignored by default and otherwise only sent for out of band
+  socket data, which caja doesn't use, so a late one does no harm.
+
+  backtrace() is not async-signal-safe.  It works from the handler once
+  libgcc is loaded, which install_sampler() sees to, but that is glibc
+  behaviour we rely on, not a promise.  So the sampler is only built with
+  --enable-debug (configure only looks for execinfo.h then), and is only
+  installed when CAJA_DROPBOX_WATCHDOG_MS is set.  Release builds install
+  no signal handler and only log the times.
+*/
+
+#define SAMPLE_SIGNAL SIGURG
+#define SAMPLE_FRAMES 64
+/* for the handler to run, in microseconds */
+#define SAMPLE_TIMEOUT (100 * 1000)
+
+/* in microseconds, 0 while off */
+static gint64 threshold;
+static pthread_t main_thread;
+/* nesting of entries, main thread only */
+static guint depth;
+
+static GMutex watch_mutex;
+static GCond watch_cond;
+/* the outermost entry running, under watch_mutex */
+static const gchar *entry_name;
+static gint64 entry_time;
+static guint entry_serial;
+static gboolean watcher_idle;
+
+static gboolean can_sample;
+
+#ifdef HAVE_EXECINFO_H
+enum { SAMPLE_NONE, SAMPLE_REQUESTED, SAMPLE_TAKEN };
+
+static gint sample_state;
+static void *sample[SAMPLE_FRAMES];
+static int sample_frames;
+
+static void take_sample(int signum) {
+  int saved_errno = errno;
+
+  if (g_atomic_int_get(&sample_state) == SAMPLE_REQUESTED) {
+    sample_frames = backtrace(sample, SAMPLE_FRAMES);
+    g_atomic_int_set(&sample_state, SAMPLE_TAKEN);
+  }
+
+  errno = saved_errno;
+}
+
+/* returns the main thread's stack, or NULL if it didn't answer in time */
+static gchar *sample_main_thread(void) {
+  gint64 deadline = g_get_monotonic_time() + SAMPLE_TIMEOUT;
+  GString *out;
+  gchar **symbols;
+  int i;
+
+  /* a sample that came in after we gave up on it */
+  g_atomic_int_compare_and_exchange(&sample_state, SAMPLE_TAKEN, SAMPLE_NONE);
+
+  /* still waiting for the last one, the main thread can't take signals */
+  if (!g_atomic_int_compare_and_exchange(&sample_state, SAMPLE_NONE,
+                                         SAMPLE_REQUESTED)) {
+    return NULL;
+  }
+
+  pthread_kill(main_thread, SAMPLE_SIGNAL);
+  while (g_atomic_int_get(&sample_state) != SAMPLE_TAKEN) {
+    if (g_get_monotonic_time() >= deadline) {
+      return NULL;
+    }
+    g_usleep(1000);
+  }
+
+  out = g_string_new(NULL);
+  /* the first two frames are the handler and the signal trampoline */
+  if ((symbols = backtrace_symbols(sample, sample_frames)) != NULL) {
+    for (i = 2; i < sample_frames; i++) {
+      g_string_append_printf(out, "\n  %s", symbols[i]);
+    }
+    free(symbols);
+  }
+  g_atomic_int_set(&sample_state, SAMPLE_NONE);
+
+  return g_string_free(out, FALSE);
+}
+
+static void install_sampler(void) {
+  struct sigaction sa, old;
+
+  /* backtrace() loads libgcc the first time, not in the handler */
+  sample_frames = backtrace(sample, SAMPLE_FRAMES);
+
+  /* leave the signal alone if caja has a use for it after all */
+  sa.sa_handler = take_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SAMPLE_SIGNAL, NULL, &old) == 0 && old.sa_handler == SIG_DFL &&
+      sigaction(SAMPLE_SIGNAL, &sa, NULL) == 0) {
+    can_sample = TRUE;
+  }
+}
+#else
+static gchar *sample_main_thread(void) { return NULL; }
+
+static void install_sampler(void) {}
+#endif
+
+static void report_stall(const gchar *name, guint serial, gint64 held) {
+  gchar *stack = can_sample ? sample_main_thread() : NULL;
+  gboolean running;
+
+  /* the stack only counts if the entry was still running after it was
+     taken */
+  g_mutex_lock(&watch_mutex);
+  running = entry_name != NULL && entry_serial == serial;
+  g_mutex_unlock(&watch_mutex);
+
+  if (running) {
+    g_message("main loop stall: %s has been running for %" G_GINT64_FORMAT
+              " ms%s",
+              name, held / 1000, stack != NULL ? stack : "");
+  }
+
+  g_free(stack);
+}
+
+static gpointer watch_main_loop(gpointer data) {
+  guint reported = 0;
+
+  g_mutex_lock(&watch_mutex);
+  for (;;) {
+    const gchar *name;
+    guint serial;
+    gint64 now, held;
+
+    if (entry_name == NULL) {
+      watcher_idle = TRUE;
+      g_cond_wait(&watch_cond, &watch_mutex);
+      watcher_idle = FALSE;
+      continue;
+    }
+
+    now = g_get_monotonic_time();
+    if (now < entry_time + threshold) {
+      g_cond_wait_until(&watch_cond, &watch_mutex, entry_time + threshold);
+      continue;
+    }
+
+    /* once per entry, then look again in a while for the next one */
+    if (entry_serial == reported) {
+      g_cond_wait_until(&watch_cond, &watch_mutex, now + threshold);
+      continue;
+    }
+
+    name = entry_name;
+    serial = reported = entry_serial;
+    held = now - entry_time;
+    g_mutex_unlock(&watch_mutex);
+    report_stall(name, serial, held);
+    g_mutex_lock(&watch_mutex);
+  }
+
+  return NULL;
+}
+
+static gboolean on_main_thread(void) {
+  return pthread_equal(pthread_self(), main_thread);
+}
+
+void dropbox_watchdog_init(void) {
+  static gsize initialized = 0;
+
+  if (g_once_init_enter(&initialized)) {
+    const gchar *ms = g_getenv("CAJA_DROPBOX_WATCHDOG_MS");
+
+    if (ms != NULL && atoi(ms) > 0) {
+      threshold = atoi(ms) * (gint64)1000;
+      main_thread = pthread_self();
+      install_sampler();
+      g_thread_new("dropbox-watchdog", watch_main_loop, NULL);
+      g_debug("watching the main loop, stalls from %s ms%s", ms,
+              can_sample ? "" : ", no stack samples");
+    }
+
+    g_once_init_leave(&initialized, 1);
+  }
+}
+
+void dropbox_watchdog_enter(const gchar *entry) {
+  if (G_LIKELY(threshold == 0) || !on_main_thread()) {
+    return;
+  }
+
+  if (depth++ > 0) {
+    return;
+  }
+
+  g_mutex_lock(&watch_mutex);
+  entry_name = entry;
+  entry_time = g_get_monotonic_time();
+  entry_serial++;
+  if (watcher_idle) {
+    g_cond_signal(&watch_cond);
+  }
+  g_mutex_unlock(&watch_mutex);
+}
+
+void dropbox_watchdog_leave(void) {
+  const gchar *name;
+  gint64 held;
+
+  if (G_LIKELY(threshold == 0) || !on_main_thread()) {
+    return;
+  }
+
+  if (--depth > 0) {
+    return;
+  }
+
+  g_mutex_lock(&watch_mutex);
+  name = entry_name;
+  held = g_get_monotonic_time() - entry_time;
+  entry_name = NULL;
+  g_mutex_unlock(&watch_mutex);
+
+  dropbox_stats_record(name, DROPBOX_STATS_MAIN_LOOP, held);
+  dropbox_stats_add("main_loop.entries", 1);
+  dropbox_stats_add("main_loop.usec", held);
+
+  if (held >= threshold) {
+    dropbox_stats_add("main_loop.stalls", 1);
+    g_message("main loop stall: %s returned after %.1f ms", name,
+              held / 1000.0);
+  }
+}
@@ -0,0 +1,49 @@
+/*
+ * dropbox-watchdog.h
+ * Header file for dropbox-watchdog.c
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DROPBOX_WATCHDOG_H
+#define DROPBOX_WATCHDOG_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* how long our code holds caja's main loop.
+
+   everything caja or the main loop calls into is bracketed by
+   dropbox_watchdog_enter() and dropbox_watchdog_leave(), nested calls only
+   count for the outermost one.  the time goes into dropbox-stats.h under
+   the entry's name, and an entry that runs for longer than
+   CAJA_DROPBOX_WATCHDOG_MS is logged, in --enable-debug builds with a
+   sample of the main thread's stack taken while it still runs.  without
+   that variable both are a single test. */
+
+/* reads CAJA_DROPBOX_WATCHDOG_MS, must be called on the main thread */
+void dropbox_watchdog_init(void);
+
+/* entry is a static string */
+void dropbox_watchdog_enter(const gchar *entry);
+
+void dropbox_watchdog_leave(void);
+
+G_END_DECLS
+
+#endif
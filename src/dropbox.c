@@ -26,6 +26,7 @@
 #endif
 
 #include <glib-object.h>
+#include <glib/gi18n-lib.h>
 
 #include "caja-dropbox.h"
 
@@ -34,10 +35,12 @@ static GType type_list[1];
 void caja_module_initialize(GTypeModule *module) {
   g_print("Initializing %s\n", PACKAGE_STRING);
 
+  /* for the column names */
+  bindtextdomain(GETTEXT_PACKAGE, LOCALEDIR);
+  bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+
   caja_dropbox_register_type(module);
   type_list[0] = CAJA_TYPE_DROPBOX;
-
-  dropbox_use_operation_in_progress_workaround = TRUE;
 }
 
 void caja_module_shutdown(void) {
@@ -0,0 +1,529 @@
+/*
+ * fake-dropboxd.c
+ * A scriptable stand-in for the Dropbox daemon, for testing and benchmarks.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  fake-dropboxd [OPTION...]
+
+  Listens on command_socket and iface_socket in HOME/.dropbox, HOME being
+  a new temporary directory unless --home says otherwise, and answers the
+  commands caja-dropbox sends:
+
+    get_emblems, icon_overlay_file_status, get_folder_tag,
+    icon_overlay_context_options, icon_overlay_context_action,
+    get_emblem_paths and negotiate_framing (with --binary-framing)
+
+  Files are up to date, except for the --syncing percentage of them picked
+  by a hash of their path.  Folders called Public are public and folders
+  with "shared" in their name are shared.
+
+  Every answer can be made to take --latency ms, give or take --jitter ms,
+  and --error-rate of them fail.  --disconnect-every hangs up the command
+  connection after that many commands.  --touches sends that many
+  shell_touch messages for paths the client asked about every
+  --touch-interval ms, a big number makes a touch storm.
+
+  On exit it prints how many commands of each kind it answered.
+*/
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dropbox-client-util.h"
+
+/* the paths asked about are the ones we touch, this many at most */
+#define SEEN_PATHS_MAX 100000
+
+typedef struct {
+  GOutputStream *out;
+  gboolean binary_framing;
+} Connection;
+
+static gchar *home;
+static gint latency;
+static gint jitter;
+static gdouble error_rate;
+static gint syncing;
+static gboolean no_emblems;
+static gboolean binary_framing;
+static gint disconnect_every;
+static gint touches;
+static gint touch_interval = 1000;
+
+static GMainLoop *main_loop;
+static gchar *dropbox_dir;
+static gchar *root;
+
+static GMutex daemon_mutex;
+/* the rest is under daemon_mutex */
+/* command name to the number of times it was answered */
+static GHashTable *answered;
+static guint errors;
+static guint disconnects;
+static guint touches_sent;
+/* of the paths asked about, and the same paths as a set */
+static GPtrArray *seen;
+static GHashTable *seen_set;
+
+static GOptionEntry entries[] = {
+    {"home", 'H', 0, G_OPTION_ARG_FILENAME, &home,
+     "Use this HOME instead of a temporary one", "DIR"},
+    {"latency", 'l', 0, G_OPTION_ARG_INT, &latency,
+     "Take this long for every answer", "MS"},
+    {"jitter", 'j', 0, G_OPTION_ARG_INT, &jitter,
+     "Take up to this much more or less", "MS"},
+    {"error-rate", 'e', 0, G_OPTION_ARG_DOUBLE, &error_rate,
+     "Answer this fraction of the commands with notok", "F"},
+    {"syncing", 's', 0, G_OPTION_ARG_INT, &syncing,
+     "Percentage of the files that are syncing", "N"},
+    {"no-emblems", 0, 0, G_OPTION_ARG_NONE, &no_emblems,
+     "Don't know get_emblems, like older daemons", NULL},
+    {"binary-framing", 'b', 0, G_OPTION_ARG_NONE, &binary_framing,
+     "Agree to binary frames", NULL},
+    {"disconnect-every", 'd', 0, G_OPTION_ARG_INT, &disconnect_every,
+     "Hang up the command connection after this many commands", "N"},
+    {"touches", 't', 0, G_OPTION_ARG_INT, &touches,
+     "Send this many shell_touch messages at a time", "N"},
+    {"touch-interval", 'i', 0, G_OPTION_ARG_INT, &touch_interval,
+     "Time between the shell_touch bursts (default 1000)", "MS"},
+    {NULL}};
+
+static void set_arg(GHashTable *args, const gchar *key, const gchar *value) {
+  gchar **vals = g_new(gchar *, 2);
+
+  vals[0] = g_strdup(value);
+  vals[1] = NULL;
+  g_hash_table_insert(args, g_strdup(key), vals);
+}
+
+static const gchar *first_arg(GHashTable *args, const gchar *key) {
+  gchar **vals = g_hash_table_lookup(args, key);
+
+  return vals != NULL ? vals[0] : NULL;
+}
+
+static void remember_path(const gchar *path) {
+  g_mutex_lock(&daemon_mutex);
+  if (seen->len < SEEN_PATHS_MAX && !g_hash_table_contains(seen_set, path)) {
+    gchar *copy = g_strdup(path);
+
+    g_ptr_array_add(seen, copy);
+    g_hash_table_add(seen_set, copy);
+  }
+  g_mutex_unlock(&daemon_mutex);
+}
+
+static const gchar *file_status(const gchar *path) {
+  if (!g_str_has_prefix(path, root)) {
+    return "unwatched";
+  }
+  return g_str_hash(path) % 100 < (guint)syncing ? "syncing" : "up to date";
+}
+
+static const gchar *folder_tag(const gchar *path) {
+  gchar *name = g_path_get_basename(path);
+  const gchar *tag = "";
+
+  if (strcmp(name, "Public") == 0) {
+    tag = "public";
+  } else if (strstr(name, "shared") != NULL) {
+    tag = "shared";
+  }
+
+  g_free(name);
+  return tag;
+}
+
+/* the reply to command_name, NULL for notok.  *switch_framing is set if
+   binary frames start after it */
+static GHashTable *answer(const gchar *command_name, GHashTable *args,
+                          gboolean *switch_framing) {
+  const gchar *path = first_arg(args, "path");
+  GHashTable *reply;
+
+  reply =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+
+  if (path != NULL) {
+    remember_path(path);
+  }
+
+  if (strcmp(command_name, "get_emblems") == 0 && path != NULL &&
+      !no_emblems) {
+    const gchar *status = file_status(path);
+
+    set_arg(reply, "emblems",
+            strcmp(status, "up to date") == 0 ? "dropbox-uptodate"
+            : strcmp(status, "syncing") == 0  ? "dropbox-syncing"
+                                              : "");
+  } else if (strcmp(command_name, "icon_overlay_file_status") == 0 &&
+             path != NULL) {
+    set_arg(reply, "status", file_status(path));
+  } else if (strcmp(command_name, "get_folder_tag") == 0 && path != NULL) {
+    set_arg(reply, "tag", folder_tag(path));
+  } else if (strcmp(command_name, "icon_overlay_context_options") == 0) {
+    gchar **options = g_new(gchar *, 4);
+
+    options[0] = g_strdup("Share...~Share the selection~share");
+    options[1] = g_strdup("Copy Dropbox Link~Copy a link~copypublic");
+    options[2] = g_strdup("View on Dropbox.com~Open the website~browse");
+    options[3] = NULL;
+    g_hash_table_insert(reply, g_strdup("options"), options);
+  } else if (strcmp(command_name, "icon_overlay_context_action") == 0) {
+    /* nothing to do, the client doesn't look at the reply */
+  } else if (strcmp(command_name, "get_emblem_paths") == 0) {
+    /* no "path", the client falls back to its own emblems */
+  } else if (strcmp(command_name, DROPBOX_FRAMING_COMMAND) == 0 &&
+             binary_framing) {
+    set_arg(reply, "framing", DROPBOX_FRAMING_BINARY);
+    *switch_framing = TRUE;
+  } else {
+    g_hash_table_destroy(reply);
+    return NULL;
+  }
+
+  return reply;
+}
+
+/* answers one command, FALSE if the client went away */
+static gboolean serve_command(Connection *conn, const gchar *command_name,
+                              GHashTable *args, guint32 request_id) {
+  gboolean switch_framing = FALSE;
+  GHashTable *reply;
+  GString *out;
+  gint64 delay;
+  gboolean ok;
+
+  delay = latency * (gint64)1000;
+  if (jitter > 0) {
+    delay += g_random_int_range(-jitter * 1000, jitter * 1000 + 1);
+  }
+  if (delay > 0) {
+    g_usleep(delay);
+  }
+
+  if (error_rate > 0 && g_random_double() < error_rate &&
+      strcmp(command_name, DROPBOX_FRAMING_COMMAND) != 0) {
+    reply = NULL;
+    g_mutex_lock(&daemon_mutex);
+    errors++;
+    g_mutex_unlock(&daemon_mutex);
+  } else {
+    reply = answer(command_name, args, &switch_framing);
+  }
+
+  out = g_string_new(NULL);
+  if (conn->binary_framing) {
+    dropbox_client_util_append_frame(
+        out, request_id, reply != NULL ? DROPBOX_FRAME_OK : DROPBOX_FRAME_ERROR,
+        NULL, reply);
+  } else {
+    /* the status line is written like a command name */
+    dropbox_client_util_append_command(out, reply != NULL ? "ok" : "notok",
+                                       reply);
+  }
+  ok = g_output_stream_write_all(conn->out, out->str, out->len, NULL, NULL,
+                                 NULL);
+  g_string_free(out, TRUE);
+  if (reply != NULL) {
+    g_hash_table_destroy(reply);
+  }
+  conn->binary_framing = conn->binary_framing || switch_framing;
+
+  g_mutex_lock(&daemon_mutex);
+  g_hash_table_replace(
+      answered, g_strdup(command_name),
+      GUINT_TO_POINTER(
+          GPOINTER_TO_UINT(g_hash_table_lookup(answered, command_name)) + 1));
+  g_mutex_unlock(&daemon_mutex);
+
+  return ok;
+}
+
+/* the lines of a text command, "done" included.  NULL on a bad arg line */
+static GHashTable *parse_command(const gchar *message, gchar **command_name) {
+  gchar **lines = g_strsplit(message, "\n", -1);
+  GHashTable *args;
+  int i;
+
+  args =
+      g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                            (GDestroyNotify)g_free, (GDestroyNotify)g_strfreev);
+  for (i = 1; lines[i] != NULL && strcmp(lines[i], "done") != 0; i++) {
+    if (dropbox_client_util_command_parse_arg(lines[i], args) == FALSE) {
+      g_hash_table_destroy(args);
+      g_strfreev(lines);
+      return NULL;
+    }
+  }
+
+  *command_name = dropbox_client_util_desanitize(lines[0]);
+  g_strfreev(lines);
+  return args;
+}
+
+/* GThreadedSocketService runs this in a thread of its own per client */
+static gboolean serve_commands(GThreadedSocketService *service,
+                               GSocketConnection *connection,
+                               GObject *source_object, gpointer user_data) {
+  GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+  GString *buf = g_string_new(NULL), *message = NULL;
+  Connection conn = {NULL, FALSE};
+  gboolean ok = TRUE;
+  gint commands = 0;
+  gssize n;
+
+  conn.out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+  while (ok) {
+    gchar chunk[16384];
+    gsize pos = 0;
+
+    if ((n = g_input_stream_read(in, chunk, sizeof(chunk), NULL, NULL)) <= 0) {
+      break;
+    }
+    g_string_append_len(buf, chunk, n);
+
+    while (ok) {
+      GHashTable *args = NULL;
+      guint32 request_id = 0;
+      gchar *name = NULL;
+
+      if (conn.binary_framing) {
+        DropboxFrameStatus status;
+        gchar kind = 0;
+
+        status = dropbox_client_util_next_frame(buf, &pos, &request_id, &kind,
+                                                &name, &args);
+        if (status == DROPBOX_FRAME_INCOMPLETE) {
+          break;
+        } else if (status == DROPBOX_FRAME_BAD ||
+                   kind != DROPBOX_FRAME_COMMAND) {
+          ok = FALSE;
+        }
+      } else {
+        gchar *line = dropbox_client_util_next_line(buf, &pos);
+
+        if (line == NULL) {
+          break;
+        }
+        if (message == NULL) {
+          message = g_string_new(NULL);
+        }
+        g_string_append(message, line);
+        g_string_append_c(message, '\n');
+        if (strcmp(line, "done") == 0) {
+          ok = (args = parse_command(message->str, &name)) != NULL;
+          g_string_free(message, TRUE);
+          message = NULL;
+        }
+        g_free(line);
+      }
+
+      if (ok && args != NULL) {
+        ok = serve_command(&conn, name, args, request_id);
+
+        if (disconnect_every > 0 && ++commands >= disconnect_every) {
+          g_mutex_lock(&daemon_mutex);
+          disconnects++;
+          g_mutex_unlock(&daemon_mutex);
+          ok = FALSE;
+        }
+      }
+      g_free(name);
+      if (args != NULL) {
+        g_hash_table_destroy(args);
+      }
+    }
+    g_string_erase(buf, 0, pos);
+  }
+
+  if (message != NULL) {
+    g_string_free(message, TRUE);
+  }
+  g_string_free(buf, TRUE);
+  g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+  return TRUE;
+}
+
+/* sends the touches while the client listens */
+static gboolean serve_hooks(GThreadedSocketService *service,
+                            GSocketConnection *connection,
+                            GObject *source_object, gpointer user_data) {
+  GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+  GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+  gchar chunk[256];
+
+  if (touches <= 0) {
+    /* nothing to say, wait for the client to hang up */
+    while (g_input_stream_read(in, chunk, sizeof(chunk), NULL, NULL) > 0) {
+    }
+    return TRUE;
+  }
+
+  for (;;) {
+    GString *burst = g_string_new(NULL);
+    gint i;
+    gboolean ok;
+
+    g_usleep(touch_interval * (gint64)1000);
+
+    g_mutex_lock(&daemon_mutex);
+    for (i = 0; i < touches; i++) {
+      GHashTable *args =
+          g_hash_table_new_full((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal,
+                                (GDestroyNotify)g_free,
+                                (GDestroyNotify)g_strfreev);
+
+      set_arg(args, "path",
+              seen->len > 0 ? (const gchar *)g_ptr_array_index(
+                                  seen, g_random_int_range(0, seen->len))
+                            : root);
+      dropbox_client_util_append_command(burst, "shell_touch", args);
+      g_hash_table_destroy(args);
+    }
+    g_mutex_unlock(&daemon_mutex);
+
+    ok = g_output_stream_write_all(out, burst->str, burst->len, NULL, NULL,
+                                   NULL);
+    g_string_free(burst, TRUE);
+    if (!ok) {
+      break;
+    }
+
+    g_mutex_lock(&daemon_mutex);
+    touches_sent += touches;
+    g_mutex_unlock(&daemon_mutex);
+  }
+
+  return TRUE;
+}
+
+static GSocketService *listen_on(const gchar *name, GCallback serve,
+                                 GError **error) {
+  struct sockaddr_un addr;
+  GSocketAddress *address;
+  GSocketService *service;
+  gchar *path;
+
+  path = g_build_filename(dropbox_dir, name, NULL);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+  /* left over from an earlier run */
+  unlink(path);
+  g_free(path);
+
+  service = g_threaded_socket_service_new(-1);
+  address = g_socket_address_new_from_native(&addr, sizeof(addr));
+  if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+                                     G_SOCKET_TYPE_STREAM,
+                                     G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+                                     error)) {
+    g_object_unref(address);
+    g_object_unref(service);
+    return NULL;
+  }
+  g_object_unref(address);
+
+  g_signal_connect(service, "run", serve, NULL);
+  g_socket_service_start(service);
+  return service;
+}
+
+static void print_report(void) {
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_mutex_lock(&daemon_mutex);
+  g_hash_table_iter_init(&iter, answered);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    g_print("%s: %u\n", (gchar *)key, GPOINTER_TO_UINT(value));
+  }
+  g_print("errors: %u, disconnects: %u, touches: %u\n", errors, disconnects,
+          touches_sent);
+  g_mutex_unlock(&daemon_mutex);
+}
+
+static gboolean quit(gpointer data) {
+  g_main_loop_quit(main_loop);
+  return TRUE;
+}
+
+int main(int argc, char **argv) {
+  GOptionContext *context;
+  GSocketService *commands, *iface;
+  GError *error = NULL;
+
+  context = g_option_context_new("- pretend to be the Dropbox daemon");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+  g_option_context_free(context);
+
+  if (home == NULL && (home = g_dir_make_tmp("fake-dropboxd-XXXXXX",
+                                             &error)) == NULL) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+  dropbox_dir = g_build_filename(home, ".dropbox", NULL);
+  root = g_build_filename(home, "Dropbox", NULL);
+  g_mkdir_with_parents(dropbox_dir, 0700);
+  g_mkdir_with_parents(root, 0700);
+
+  answered = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  seen = g_ptr_array_new_with_free_func(g_free);
+  seen_set = g_hash_table_new(g_str_hash, g_str_equal);
+
+  /* a client hanging up in the middle of a write */
+  signal(SIGPIPE, SIG_IGN);
+
+  main_loop = g_main_loop_new(NULL, FALSE);
+  if ((commands = listen_on("command_socket", G_CALLBACK(serve_commands),
+                            &error)) == NULL ||
+      (iface = listen_on("iface_socket", G_CALLBACK(serve_hooks), &error)) ==
+          NULL) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+  g_unix_signal_add(SIGINT, quit, NULL);
+  g_unix_signal_add(SIGTERM, quit, NULL);
+
+  /* scripts wait for this line to know the sockets are up */
+  g_print("HOME=%s\n", home);
+  fflush(stdout);
+  g_main_loop_run(main_loop);
+
+  g_socket_service_stop(commands);
+  g_socket_service_stop(iface);
+  print_report();
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * test-canonicalize-path.c
+ * Checks dropbox_client_util_canonicalize_path_into against the old
+ * canonicalize_path.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "dropbox-client-util.h"
+
+/* random paths per run, more with -m slow */
+#define FUZZ_PATHS 200000
+#define FUZZ_PATHS_SLOW 3000000
+#define FUZZ_MAX_LEN 24
+
+/* canonicalize_path as it was before it became a single pass, kept
+   verbatim as the reference */
+static gchar *old_canonicalize_path(gchar *path) {
+  int i, j = 0;
+  gchar *toret = NULL;
+  gchar **cpy, **elts;
+
+  g_assert(path != NULL);
+  g_assert(path[0] == '/');
+
+  elts = g_strsplit(path, "/", 0);
+  cpy = g_new(gchar *, g_strv_length(elts) + 1);
+  cpy[j++] = "/";
+  for (i = 0; elts[i] != NULL; i++) {
+    if (strcmp(elts[i], "..") == 0) {
+      if (j > 0) {
+        j--;
+      } else {
+        // Input path has too many parent directory references and is invalid
+        toret = NULL;
+        goto exit;
+      }
+    } else if (strcmp(elts[i], ".") != 0 && elts[i][0] != '\0') {
+      cpy[j++] = elts[i];
+    }
+  }
+
+  cpy[j] = NULL;
+  toret = g_build_filenamev(cpy);
+
+exit:
+  g_free(cpy);
+  g_strfreev(elts);
+
+  return toret;
+}
+
+/* both into a separate buffer and in place */
+static void check_path(const gchar *path) {
+  gchar *expected = old_canonicalize_path((gchar *)path);
+  gchar *out = g_malloc(strlen(path) + 1);
+  gchar *in_place = g_strdup(path);
+  gboolean valid;
+
+  valid = dropbox_client_util_canonicalize_path_into(path, out);
+  if (expected == NULL) {
+    if (valid) {
+      g_test_message("%s: old rejects it, new gives %s", path, out);
+    }
+    g_assert_false(valid);
+  } else {
+    g_assert_true(valid);
+    if (strcmp(out, expected) != 0) {
+      g_test_message("%s: old gives %s, new %s", path, expected, out);
+    }
+    g_assert_cmpstr(out, ==, expected);
+  }
+
+  g_assert_true(dropbox_client_util_canonicalize_path_into(
+                    in_place, in_place) == valid);
+  if (valid) {
+    g_assert_cmpstr(in_place, ==, expected);
+  }
+
+  g_free(in_place);
+  g_free(out);
+  g_free(expected);
+}
+
+static void test_paths(void) {
+  static const gchar *paths[] = {
+      "/", "//", "/.", "/./", "/a", "/a/", "/a//b", "/a/./b", "/a/b/..",
+      "/a/b/../..", "/a/../b", "/a/b/c/../../d", "/.a", "/..a", "/a..",
+      "/...", "/a/...", "/a/.../b",
+      /* going above / drops the root, doing it twice is invalid */
+      "/..", "/../", "/../a", "/../a/b", "/../a/..", "/../a/../..",
+      "/a/../..", "/a/../../b", "/../..", "/../../a", "/a/../../..",
+      "/./../.", "//..//a//", "/../a/../b/c/..", NULL};
+  const gchar **p;
+
+  for (p = paths; *p != NULL; p++) {
+    check_path(*p);
+  }
+}
+
+/* paths made of '/', '.' and 'a', short enough to hit every combination
+   of the separators and navigation elements often */
+static void test_fuzz(void) {
+  static const gchar alphabet[] = "/./.a";
+  GRand *rand = g_rand_new_with_seed(g_test_rand_int());
+  gint n = g_test_slow() ? FUZZ_PATHS_SLOW : FUZZ_PATHS;
+  gchar path[FUZZ_MAX_LEN + 2];
+  gint i;
+
+  for (i = 0; i < n; i++) {
+    gint len = g_rand_int_range(rand, 0, FUZZ_MAX_LEN + 1), j;
+
+    path[0] = '/';
+    for (j = 1; j <= len; j++) {
+      path[j] = alphabet[g_rand_int_range(rand, 0, sizeof(alphabet) - 1)];
+    }
+    path[len + 1] = '\0';
+
+    check_path(path);
+  }
+
+  g_rand_free(rand);
+}
+
+int main(int argc, char **argv) {
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/canonicalize-path/paths", test_paths);
+  g_test_add_func("/canonicalize-path/fuzz", test_fuzz);
+
+  return g_test_run();
+}
@@ -0,0 +1,390 @@
+/*
+ * test-info-provider.c
+ * Drives the extension's info provider like caja does, against
+ * fake-dropboxd.
+ *
+ * This file is part of caja-dropbox.
+ *
+ * caja-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * caja-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with caja-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  The extension is linked in and loaded through a GTypeModule, as caja
+  loads it.  The files are TestFile objects that count what the extension
+  does to them, and fake-dropboxd plays the daemon.
+
+  Caja draws a file when update_file_info returns, or when update_complete
+  is invoked for an operation in progress, and again whenever the file is
+  invalidated.  Each file must be drawn exactly once, with its emblems, and
+  a cancelled handle must never be completed.
+
+  Exits 77, skipped for make check, without a display: the emblem search
+  path lives on the default icon theme.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <gtk/gtk.h>
+#include <libcaja-extension/caja-extension-types.h>
+#include <libcaja-extension/caja-file-info.h>
+#include <libcaja-extension/caja-info-provider.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "caja-dropbox.h"
+
+#define FILES 200
+/* how long we give late completions and invalidations to show up */
+#define SETTLE_MS 300
+#define TIMEOUT_SEC 20
+
+typedef struct {
+  GObject parent;
+  gchar *uri;
+  gboolean is_dir;
+  /* what happened to the file */
+  guint completions;
+  guint status_attributes;
+  guint invalidations;
+} TestFile;
+
+typedef GObjectClass TestFileClass;
+
+static void test_file_info_iface_init(CajaFileInfoIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(TestFile, test_file, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(CAJA_TYPE_FILE_INFO,
+                                              test_file_info_iface_init))
+
+static gchar *test_file_get_uri(CajaFileInfo *info) {
+  return g_strdup(((TestFile *)info)->uri);
+}
+
+static gboolean test_file_is_directory(CajaFileInfo *info) {
+  return ((TestFile *)info)->is_dir;
+}
+
+static gboolean test_file_is_gone(CajaFileInfo *info) { return FALSE; }
+
+static void test_file_add_emblem(CajaFileInfo *info, const char *emblem) {}
+
+static void test_file_add_string_attribute(CajaFileInfo *info,
+                                           const char *attribute_name,
+                                           const char *value) {
+  /* the extension sets it once per answer, emblems or not */
+  if (strcmp(attribute_name, "dropbox_status") == 0) {
+    ((TestFile *)info)->status_attributes++;
+  }
+}
+
+static void test_file_invalidate_extension_info(CajaFileInfo *info) {
+  ((TestFile *)info)->invalidations++;
+}
+
+static void test_file_info_iface_init(CajaFileInfoIface *iface) {
+  iface->get_uri = test_file_get_uri;
+  iface->is_directory = test_file_is_directory;
+  iface->is_gone = test_file_is_gone;
+  iface->add_emblem = test_file_add_emblem;
+  iface->add_string_attribute = test_file_add_string_attribute;
+  iface->invalidate_extension_info = test_file_invalidate_extension_info;
+}
+
+static void test_file_finalize(GObject *object) {
+  g_free(((TestFile *)object)->uri);
+  G_OBJECT_CLASS(test_file_parent_class)->finalize(object);
+}
+
+static void test_file_class_init(TestFileClass *klass) {
+  klass->finalize = test_file_finalize;
+
+  /* CajaFile has it, the extension watches it for moves */
+  g_signal_new("changed", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST, 0,
+               NULL, NULL, NULL, G_TYPE_NONE, 0);
+}
+
+static void test_file_init(TestFile *file) {}
+
+static TestFile *test_file_new(const gchar *name, gboolean is_dir) {
+  TestFile *file = g_object_new(test_file_get_type(), NULL);
+  gchar *path = g_build_filename(g_get_home_dir(), "Dropbox", name, NULL);
+
+  file->uri = g_filename_to_uri(path, NULL, NULL);
+  file->is_dir = is_dir;
+  g_free(path);
+
+  return file;
+}
+
+/* the module, loaded like caja loads extensions */
+typedef GTypeModule TestModule;
+typedef GTypeModuleClass TestModuleClass;
+
+G_DEFINE_TYPE(TestModule, test_module, G_TYPE_TYPE_MODULE)
+
+static gboolean test_module_load(GTypeModule *module) {
+  caja_module_initialize(module);
+  return TRUE;
+}
+
+static void test_module_unload(GTypeModule *module) {
+  caja_module_shutdown();
+}
+
+static void test_module_class_init(TestModuleClass *klass) {
+  klass->load = test_module_load;
+  klass->unload = test_module_unload;
+}
+
+static void test_module_init(TestModule *module) {}
+
+static CajaInfoProvider *provider;
+static GPid daemon_pid;
+
+typedef gboolean (*Condition)(gpointer data);
+
+static gboolean wake_up(gpointer data) { return TRUE; }
+
+/* runs the main loop until condition holds, FALSE if it never did */
+static gboolean wait_for(Condition condition, gpointer data) {
+  gint64 deadline = g_get_monotonic_time() + TIMEOUT_SEC * G_USEC_PER_SEC;
+  guint wake = g_timeout_add(10, wake_up, NULL);
+  gboolean held;
+
+  while (!(held = condition(data)) && g_get_monotonic_time() < deadline) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+
+  g_source_remove(wake);
+  return held;
+}
+
+static gboolean settled(gpointer data) {
+  return g_get_monotonic_time() >= *(gint64 *)data;
+}
+
+/* lets late callbacks run */
+static void settle(void) {
+  gint64 until = g_get_monotonic_time() + SETTLE_MS * 1000;
+
+  wait_for(settled, &until);
+}
+
+static gboolean ready(gpointer data) {
+  CajaDropboxInstance *inst =
+      g_ptr_array_index(CAJA_DROPBOX(provider)->instances, 0);
+
+  /* new emblem paths redraw every file with emblems, let that happen
+     before the files show up */
+  return dropbox_client_is_connected(&(inst->dc)) &&
+         inst->emblem_paths != NULL;
+}
+
+static gboolean all_completed(gpointer data) {
+  GPtrArray *files = data;
+  guint i;
+
+  for (i = 0; i < files->len; i++) {
+    TestFile *file = g_ptr_array_index(files, i);
+
+    /* the cancelled ones are marked by a completion count of G_MAXUINT */
+    if (file->completions == 0) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void update_complete(CajaInfoProvider *p, CajaOperationHandle *handle,
+                            CajaOperationResult result, TestFile *file) {
+  g_assert_cmpint(result, ==, CAJA_OPERATION_COMPLETE);
+  file->completions++;
+}
+
+/* asks for file's info as caja does, the handle if it's in progress */
+static CajaOperationHandle *update_file(TestFile *file) {
+  CajaOperationHandle *handle = NULL;
+  CajaOperationResult result;
+  GClosure *closure;
+
+  closure = g_cclosure_new(G_CALLBACK(update_complete), file, NULL);
+  g_closure_set_marshal(closure, g_cclosure_marshal_generic);
+
+  result = caja_info_provider_update_file_info(provider, CAJA_FILE_INFO(file),
+                                               closure, &handle);
+  g_closure_unref(closure);
+
+  if (result == CAJA_OPERATION_IN_PROGRESS) {
+    g_assert_nonnull(handle);
+    return handle;
+  }
+
+  g_assert_cmpint(result, ==, CAJA_OPERATION_COMPLETE);
+  file->completions++;
+  return NULL;
+}
+
+static GPtrArray *make_files(const gchar *prefix) {
+  GPtrArray *files = g_ptr_array_new_with_free_func(g_object_unref);
+  guint i;
+
+  for (i = 0; i < FILES; i++) {
+    gchar *name = g_strdup_printf("%s-%u", prefix, i);
+
+    g_ptr_array_add(files, test_file_new(name, i % 10 == 0));
+    g_free(name);
+  }
+
+  return files;
+}
+
+static void test_drawn_once(void) {
+  GPtrArray *files = make_files("drawn-once");
+  guint i, in_progress = 0;
+
+  for (i = 0; i < files->len; i++) {
+    if (update_file(g_ptr_array_index(files, i)) != NULL) {
+      in_progress++;
+    }
+  }
+  /* nothing is known about them yet, all of them need the daemon */
+  g_assert_cmpuint(in_progress, ==, files->len);
+
+  g_assert_true(wait_for(all_completed, files));
+  settle();
+
+  for (i = 0; i < files->len; i++) {
+    TestFile *file = g_ptr_array_index(files, i);
+
+    g_assert_cmpuint(file->completions, ==, 1);
+    g_assert_cmpuint(file->status_attributes, ==, 1);
+    g_assert_cmpuint(file->invalidations, ==, 0);
+  }
+
+  g_ptr_array_free(files, TRUE);
+}
+
+static void test_cancelled(void) {
+  GPtrArray *files = make_files("cancelled");
+  guint i;
+
+  for (i = 0; i < files->len; i++) {
+    TestFile *file = g_ptr_array_index(files, i);
+    CajaOperationHandle *handle = update_file(file);
+
+    g_assert_nonnull(handle);
+    /* every other one, the last one is kept so its answer tells us that
+       the others have been answered as well */
+    if (i % 2 == 0) {
+      caja_info_provider_cancel_update(provider, handle);
+      file->completions = G_MAXUINT;
+    }
+  }
+
+  g_assert_true(wait_for(all_completed, files));
+  settle();
+
+  for (i = 0; i < files->len; i++) {
+    TestFile *file = g_ptr_array_index(files, i);
+
+    if (i % 2 == 0) {
+      g_assert_cmpuint(file->completions, ==, G_MAXUINT);
+      g_assert_cmpuint(file->status_attributes, ==, 0);
+    } else {
+      g_assert_cmpuint(file->completions, ==, 1);
+      g_assert_cmpuint(file->status_attributes, ==, 1);
+    }
+    g_assert_cmpuint(file->invalidations, ==, 0);
+  }
+
+  g_ptr_array_free(files, TRUE);
+}
+
+/* starts fake-dropboxd and moves HOME to the one it made */
+static gboolean start_daemon(void) {
+  gchar *argv[] = {NULL, "--latency", "1", "--jitter", "1", NULL};
+  gchar line[4096];
+  GError *error = NULL;
+  gint out;
+  FILE *f;
+
+  argv[0] = g_test_build_filename(G_TEST_BUILT, "fake-dropboxd", NULL);
+  if (!g_spawn_async_with_pipes(NULL, argv, NULL, G_SPAWN_DEFAULT, NULL, NULL,
+                                &daemon_pid, NULL, &out, NULL, &error)) {
+    g_printerr("couldn't start %s: %s\n", argv[0], error->message);
+    g_error_free(error);
+    g_free(argv[0]);
+    return FALSE;
+  }
+  g_free(argv[0]);
+
+  /* it prints HOME=... once the sockets are up */
+  f = fdopen(out, "r");
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (g_str_has_prefix(line, "HOME=")) {
+      g_strchomp(line);
+      g_setenv("HOME", line + strlen("HOME="), TRUE);
+      return TRUE;
+    }
+  }
+
+  g_printerr("fake-dropboxd didn't start\n");
+  return FALSE;
+}
+
+int main(int argc, char **argv) {
+  GTypeModule *module;
+  const GType *types;
+  int num_types, result;
+
+  g_test_init(&argc, &argv, NULL);
+
+  /* before anything asks glib for the home directory */
+  if (!start_daemon()) {
+    return 1;
+  }
+  g_unsetenv("CAJA_DROPBOX_INSTANCES");
+  g_setenv("CAJA_DROPBOX_EAGER_START", "1", TRUE);
+
+  if (!gtk_init_check(&argc, &argv)) {
+    g_print("no display, skipped\n");
+    kill(daemon_pid, SIGTERM);
+    return 77;
+  }
+
+  module = g_object_new(test_module_get_type(), NULL);
+  g_type_module_use(module);
+  caja_module_list_types(&types, &num_types);
+  g_assert_cmpint(num_types, ==, 1);
+  provider = g_object_new(types[0], NULL);
+
+  if (!wait_for(ready, NULL)) {
+    g_printerr("the extension never connected to fake-dropboxd\n");
+    kill(daemon_pid, SIGTERM);
+    return 1;
+  }
+
+  g_test_add_func("/info-provider/drawn-once", test_drawn_once);
+  g_test_add_func("/info-provider/cancelled", test_cancelled);
+
+  result = g_test_run();
+
+  kill(daemon_pid, SIGTERM);
+  return result;
+}